@@ -0,0 +1,86 @@
+#!/bin/bash
+# Goodput benchmark: pipe a known payload between two reliable
+# endpoints over a local lossy link (bench/lossy.c) and report
+# completion time, goodput and retransmit ratio for every -w/-t pair.
+#
+#   bench/goodput.sh            run from the top of the tree
+#
+# Environment:
+#   SIZE      payload bytes                    (default 1000000)
+#   WINDOWS   -w values to sweep               (default "1 8 32")
+#   TIMEOUTS  -t values to sweep               (default "100 500")
+#   LINK      lossy link options               (default "-l 1 -r 1 -D 0.5 -c 0.5 -d 5 -j 1")
+#   SEED      seed for payload and link        (default 1)
+#   LIMIT     seconds before a run is a hang   (default 120)
+#   PORT      first UDP port to use            (default 7100)
+#   BUILD     build directory                  (default _bench_build)
+#   CFLAGS    compiler flags                   (default -O2)
+#
+# retx is data packets the sender put on the wire divided by the
+# highest sequence number, minus one.
+
+SIZE=${SIZE:-1000000}
+WINDOWS=${WINDOWS:-"1 8 32"}
+TIMEOUTS=${TIMEOUTS:-"100 500"}
+LINK=${LINK:-"-l 1 -r 1 -D 0.5 -c 0.5 -d 5 -j 1"}
+SEED=${SEED:-1}
+LIMIT=${LIMIT:-120}
+PORT=${PORT:-7100}
+BUILD=${BUILD:-_bench_build}
+CFLAGS=${CFLAGS:--O2}
+CC=${CC:-cc}
+
+set -e
+mkdir -p "$BUILD"
+$CC $CFLAGS -pthread -o "$BUILD/reliable" rlib.c reliable.c stats.c lz.c ring.c logq.c pipeline.c
+$CC $CFLAGS -pthread -DRLIB_NO_MAIN=1 -o "$BUILD/lossy" bench/lossy.c \
+    rlib.c reliable.c stats.c lz.c ring.c logq.c pipeline.c
+"$BUILD/lossy" -s "$SEED" -G "$SIZE" > "$BUILD/payload"
+set +e
+
+echo "# size $SIZE link: $LINK seed $SEED"
+printf "%6s %6s %9s %12s %7s  %s\n" window tmo secs "goodput/kBs" retx result
+
+for w in $WINDOWS; do
+    for t in $TIMEOUTS; do
+        pa=$PORT; pb=$((PORT+1)); ea=$((PORT+2)); eb=$((PORT+3))
+        PORT=$((PORT+4))
+
+        "$BUILD/lossy" $LINK -s "$SEED" $pa $pb localhost:$ea localhost:$eb \
+            2> "$BUILD/lossy.log" &
+        lp=$!
+        sleep 0.2
+
+        start=$(date +%s.%N)
+        timeout $LIMIT "$BUILD/reliable" -w $w -t $t $eb localhost:$pb \
+            < /dev/null > "$BUILD/out" 2> "$BUILD/b.log" &
+        rp=$!
+        timeout $LIMIT "$BUILD/reliable" -w $w -t $t $ea localhost:$pa \
+            < "$BUILD/payload" > /dev/null 2> "$BUILD/a.log" &
+        sp=$!
+
+        wait $rp
+        rc=$?
+        end=$(date +%s.%N)
+        # The sender may linger if the very last ack got lost
+        (sleep 2; kill $sp 2> /dev/null) &
+        wait $sp
+        kill $lp; wait $lp
+
+        if cmp -s "$BUILD/payload" "$BUILD/out"; then
+            result=ok
+        elif [ $rc = 124 ]; then
+            result=timeout
+        else
+            result=FAIL
+        fi
+        awk -v w=$w -v t=$t -v s=$start -v e=$end -v size=$SIZE -v r=$result '
+            /^a->b:/ { data = $5; maxseq = $11 }
+            END {
+                secs = e - s
+                retx = maxseq ? data / maxseq - 1 : 0
+                printf "%6d %6d %9.3f %12.1f %7.3f  %s\n",
+                       w, t, secs, size / secs / 1000, retx, r
+            }' "$BUILD/lossy.log"
+    done
+done
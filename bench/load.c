@@ -0,0 +1,595 @@
+/* Load generator for reliable -s.
+
+   load opens many client sessions from one process against a server
+   and reports how it copes.  Each session has a UDP socket of its
+   own, so the server sees a client per session, and runs reliable.c
+   as in bench/sim.c, against bench/stub.c, but with the real clock
+   and its packets on the real socket.  The server relays every
+   session to a TCP connection; load accepts those itself on
+   sink-port, checks and counts the bytes and closes each once the
+   session's EOF comes through, which lets the server finish the
+   session and the client side after it.
+
+     reliable -s 7000 localhost:7100 &
+     load -n 5000 -c 2000 -r 500 -p $! localhost:7000 7100
+
+   Sessions arrive -r per second, at exponential intervals (all at
+   once without -r), at most -c at a time, until -n have started.
+   Each sends -s bytes, or a uniformly random size with -s min,max,
+   and keeps the session open for at least -L seconds before it
+   sends EOF.
+
+   Reported are
+     setup     time from a session's first packet to the server's
+               first answer, and sessions set up per second
+     goodput   bytes through to the sink per second of the run
+     fairness  Jain's index over the goodput of each sink connection,
+               from accept to EOF (1 is all equal), and its spread
+     server    cpu time and cores used during the run, and resident
+               memory, of every -p pid and its children together
+   and the protocol counters of the client side.
+
+   usage: load [-n sessions] [-c concurrent] [-r sessions/s]
+               [-s bytes[,max-bytes]] [-L lifetime-s] [-w window]
+               [-t timeout-ms] [-z] [-p server-pid]... [-S seed]
+               [-T limit-s] [-v] [host:]udp-port sink-port
+
+   Linux only (epoll, /proc).  A session is a socket at each end and
+   a TCP connection through the sink, so load raises its open file
+   limit as far as it may; the server may need ulimit -n too.
+
+   Build: cc -O2 -DRLIB_UTIL_ONLY=1 -o load bench/load.c bench/stub.c \
+              rlib.c reliable.c stats.c lz.c -lm  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "stub.h"
+#include "../stats.h"
+
+#define MAX_PIDS 16
+
+enum { EP_LISTEN, EP_SESSION, EP_SINK };	/* what an epoll event is for */
+
+struct session {
+    char kind;			/* EP_SESSION */
+    char live;			/* rel not destroyed yet */
+    char eof_given;		/* conn_input returned -1 */
+    char failed;			/* server unreachable */
+    int fd;
+    conn_t *c;
+    uint64_t in_size;		/* bytes this session sends */
+    uint64_t in_off;		/* bytes handed to conn_input */
+    uint64_t start;		/* usec */
+    uint64_t setup;		/* first packet from the server, 0 before */
+    struct session *next, **prev;	/* live sessions */
+};
+
+struct sink {
+    char kind;			/* EP_SINK */
+    int fd;
+    uint64_t bytes;
+    uint64_t accepted;		/* usec */
+};
+
+static struct {
+    long sessions;
+    long concurrent;
+    double rate;			/* sessions/s, 0 = no pacing */
+    uint64_t size, size_max;
+    uint64_t lifetime;		/* usec */
+    int window;
+    int timeout;
+    int compress;
+    int pids[MAX_PIDS];
+    int npids;
+    uint64_t limit;		/* usec */
+    int verbose;
+} opt = {
+    .sessions = 1000, .concurrent = 1000000, .size = 100000,
+    .window = 8, .timeout = 500, .limit = 600ULL * 1000000,
+};
+
+static const char listen_kind = EP_LISTEN;
+static int ep;
+static struct sockaddr_storage server;
+static struct config_common cc;
+static uint64_t rng_state = 88172645463325252ULL;
+static struct session *sessions, *live_list;
+static long started, live, completed, failed, established;
+static uint64_t first_start, last_setup;
+static struct hist setup;
+
+static long sink_open, sink_done;
+static uint64_t sink_bytes, sink_corrupt;
+static double *rates;			/* bytes/s of each finished sink connection */
+static long nrates, rates_size;
+
+static volatile sig_atomic_t stop;
+
+static uint64_t
+rng (void)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ULL;
+}
+
+static double
+rng_unit (void)
+{
+    return (rng () >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static uint64_t
+mono_usec (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static inline unsigned char
+pattern (uint64_t off)
+{
+    return (off * 131 + (off >> 9)) & 0xff;
+}
+
+static void
+ep_add (int fd, const void *ptr)
+{
+    struct epoll_event e;
+
+    e.events = EPOLLIN;
+    e.data.ptr = (void *) ptr;
+    if (epoll_ctl (ep, EPOLL_CTL_ADD, fd, &e) < 0) {
+        perror ("epoll_ctl");
+        exit (1);
+    }
+}
+
+/* Server side: /proc numbers of one process */
+static int
+proc_read (int pid, double *cpu, uint64_t *rss)
+{
+    char path[64], buf[1024], *p;
+    unsigned long ut, st, kb;
+    FILE *f;
+    size_t n;
+
+    snprintf (path, sizeof (path), "/proc/%d/stat", pid);
+    if (!(f = fopen (path, "r")))
+        return -1;
+    n = fread (buf, 1, sizeof (buf) - 1, f);
+    fclose (f);
+    buf[n] = 0;
+    /* The name in parentheses may have spaces in it */
+    if (!(p = strrchr (buf, ')'))
+            || sscanf (p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u"
+                       " %lu %lu", &ut, &st) != 2)
+        return -1;
+    *cpu += (double) (ut + st) / sysconf (_SC_CLK_TCK);
+
+    snprintf (path, sizeof (path), "/proc/%d/status", pid);
+    if (!(f = fopen (path, "r")))
+        return -1;
+    while (fgets (buf, sizeof (buf), f))
+        if (sscanf (buf, "VmRSS: %lu kB", &kb) == 1)
+            *rss += (uint64_t) kb * 1024;
+    fclose (f);
+    return 0;
+}
+
+/* The -p processes and their children (server workers), together */
+static void
+server_sample (double *cpu, uint64_t *rss)
+{
+    char path[64];
+    FILE *f;
+    int i, child;
+
+    *cpu = 0;
+    *rss = 0;
+    for (i = 0; i < opt.npids; i++) {
+        proc_read (opt.pids[i], cpu, rss);
+        snprintf (path, sizeof (path), "/proc/%d/task/%d/children",
+                  opt.pids[i], opt.pids[i]);
+        if (!(f = fopen (path, "r")))
+            continue;
+        while (fscanf (f, "%d", &child) == 1)
+            proc_read (child, cpu, rss);
+        fclose (f);
+    }
+}
+
+static void
+udp_send (conn_t *c, const packet_t *pkt, size_t len)
+{
+    struct session *s = c->arg;
+
+    /* A full socket buffer is a lost packet, reliable.c sends it again */
+    send (s->fd, pkt, len, 0);
+}
+
+static int
+gen_input (conn_t *c, void *buf, size_t len)
+{
+    struct session *s = c->arg;
+    unsigned char *p = buf;
+    size_t i;
+
+    if (s->in_off == s->in_size) {
+        if (stub_clock < s->start + opt.lifetime)
+            return 0;
+        s->eof_given = 1;
+        return -1;
+    }
+    if (len > s->in_size - s->in_off)
+        len = s->in_size - s->in_off;
+    for (i = 0; i < len; i++)
+        p[i] = pattern (s->in_off + i);
+    s->in_off += len;
+    return len;
+}
+
+/* As in sim.c: input is always readable, so read until the window is
+   full or input is over. */
+static void
+pump (struct session *s)
+{
+    while (!s->c->destroyed && !s->eof_given) {
+        uint64_t off = s->in_off;
+        rel_read (s->c->rel);
+        if (s->in_off == off && !s->eof_given)
+            break;
+    }
+}
+
+/* Once reliable.c is done with a session, close it */
+static void
+reap (struct session *s)
+{
+    if (!s->live || !s->c->destroyed)
+        return;
+    close (s->fd);
+    stub_conn_free (s->c);
+    s->c = NULL;
+    s->live = 0;
+    if (s->next)
+        s->next->prev = s->prev;
+    *s->prev = s->next;
+    live--;
+    if (s->failed)
+        failed++;
+    else
+        completed++;
+}
+
+static void
+session_start (struct session *s)
+{
+    s->kind = EP_SESSION;
+    s->start = stub_clock;
+    if (!first_start)
+        first_start = stub_clock;
+    s->in_size = opt.size;
+    if (opt.size_max > opt.size)
+        s->in_size += rng () % (opt.size_max - opt.size + 1);
+    started++;
+    if ((s->fd = connect_to (1, &server)) < 0) {
+        failed++;
+        return;
+    }
+    ep_add (s->fd, s);
+
+    s->c = stub_conn ();
+    s->c->arg = s;
+    s->c->send = udp_send;
+    s->c->input = gen_input;
+    s->live = 1;
+    s->prev = &live_list;
+    s->next = live_list;
+    if (live_list)
+        live_list->prev = &s->next;
+    live_list = s;
+    live++;
+    s->c->rel = rel_create (s->c, NULL, &cc);
+    pump (s);
+}
+
+static void
+session_recv (struct session *s)
+{
+    packet_t pkt;
+    int i, len;
+
+    for (i = 0; i < 64 && !s->c->destroyed; i++) {
+        if ((len = recv (s->fd, &pkt, sizeof (pkt), 0)) < 0) {
+            if (errno != EAGAIN) {
+                /* ICMP port unreachable, as rlib: the server is gone */
+                s->failed = 1;
+                rel_destroy (s->c->rel);
+            }
+            break;
+        }
+        if (!s->setup) {
+            s->setup = stub_clock;
+            last_setup = stub_clock;
+            established++;
+            hist_record (&setup, s->setup - s->start);
+        }
+        rel_recvpkt (s->c->rel, &pkt, len);
+    }
+    if (!s->c->destroyed)
+        pump (s);
+    reap (s);
+}
+
+static void
+sink_accept (int lfd)
+{
+    struct sink *k;
+    int fd;
+
+    while ((fd = accept (lfd, NULL, NULL)) >= 0) {
+        make_async (fd);
+        k = xmalloc (sizeof (*k));
+        memset (k, 0, sizeof (*k));
+        k->kind = EP_SINK;
+        k->fd = fd;
+        k->accepted = stub_clock;
+        ep_add (fd, k);
+        sink_open++;
+    }
+    if (errno != EAGAIN && errno != EINTR)
+        perror ("accept");
+}
+
+static void
+sink_read (struct sink *k)
+{
+    unsigned char buf[65536];
+    ssize_t n, i;
+
+    while ((n = read (k->fd, buf, sizeof (buf))) > 0) {
+        for (i = 0; i < n; i++)
+            if (buf[i] != pattern (k->bytes + i)) {
+                sink_corrupt++;
+                break;
+            }
+        k->bytes += n;
+        sink_bytes += n;
+    }
+    if (n < 0 && errno == EAGAIN)
+        return;
+
+    /* EOF: the session's data is all here */
+    if (nrates == rates_size) {
+        rates_size = rates_size ? 2 * rates_size : 1024;
+        if (!(rates = realloc (rates, rates_size * sizeof (*rates)))) {
+            perror ("realloc");
+            exit (1);
+        }
+    }
+    if (k->bytes)
+        rates[nrates++] = k->bytes * 1e6 / (stub_clock - k->accepted + 1);
+    close (k->fd);
+    free (k);
+    sink_open--;
+    sink_done++;
+}
+
+static int
+cmp_double (const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return x < y ? -1 : x > y;
+}
+
+static void
+stop_handler (int sig)
+{
+    stop = 1;
+}
+
+static void
+usage (void)
+{
+    fprintf (stderr,
+             "usage: %s [-n sessions] [-c concurrent] [-r sessions/s]\n"
+             "          [-s bytes[,max-bytes]] [-L lifetime-s] [-w window]\n"
+             "          [-t timeout-ms] [-z] [-p server-pid]... [-S seed]\n"
+             "          [-T limit-s] [-v] [host:]udp-port sink-port\n", progname);
+    exit (1);
+}
+
+int
+main (int argc, char **argv)
+{
+    struct epoll_event evs[256];
+    struct sockaddr_storage sl;
+    struct rlimit rl;
+    struct sigaction act;
+    uint64_t t0, t_end, next_arrival, next_timer, next_report, timer;
+    double cpu0 = 0, cpu1 = 0, secs, sum = 0, sum2 = 0;
+    uint64_t rss = 0, rss_peak = 0;
+    clock_t own_cpu;
+    char *comma;
+    int lfd, o, i, n;
+
+    progname = "load";
+    while ((o = getopt (argc, argv, "n:c:r:s:L:w:t:zp:S:T:v")) != -1)
+        switch (o) {
+        case 'n': opt.sessions = atol (optarg); break;
+        case 'c': opt.concurrent = atol (optarg); break;
+        case 'r': opt.rate = atof (optarg); break;
+        case 's': opt.size = strtoull (optarg, &comma, 0);
+                  if (*comma == ',')
+                      opt.size_max = strtoull (comma + 1, NULL, 0);
+                  break;
+        case 'L': opt.lifetime = atof (optarg) * 1000000; break;
+        case 'w': opt.window = atoi (optarg); break;
+        case 't': opt.timeout = atoi (optarg); break;
+        case 'z': opt.compress = 1; break;
+        case 'p': if (opt.npids == MAX_PIDS)
+                      usage ();
+                  opt.pids[opt.npids++] = atoi (optarg);
+                  break;
+        case 'S': rng_state ^= strtoull (optarg, NULL, 0) * 0x9E3779B97F4A7C15ULL;
+                  if (!rng_state) rng_state = 1;
+                  break;
+        case 'T': opt.limit = atof (optarg) * 1000000; break;
+        case 'v': opt.verbose = 1; break;
+        default: usage ();
+        }
+    if (optind + 2 != argc || opt.sessions < 1 || opt.concurrent < 1
+            || opt.rate < 0 || opt.window < 1 || opt.timeout < 10)
+        usage ();
+
+    /* A socket per session and one per sink connection */
+    if (getrlimit (RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit (RLIMIT_NOFILE, &rl);
+    }
+    memset (&act, 0, sizeof (act));
+    act.sa_handler = stop_handler;
+    sigaction (SIGINT, &act, NULL);
+    sigaction (SIGTERM, &act, NULL);
+    act.sa_handler = SIG_IGN;
+    sigaction (SIGPIPE, &act, NULL);
+
+    if ((ep = epoll_create1 (EPOLL_CLOEXEC)) < 0) {
+        perror ("epoll_create1");
+        exit (1);
+    }
+    if (get_address (&server, 0, 1, AF_INET, argv[optind]) < 0
+            || get_address (&sl, 1, 0, server.ss_family, argv[optind + 1]) < 0
+            || (lfd = listen_on (0, &sl)) < 0)
+        exit (1);
+    make_async (lfd);
+    ep_add (lfd, &listen_kind);
+
+    memset (&cc, 0, sizeof (cc));
+    cc.window = opt.window;
+    cc.timeout = opt.timeout;
+    cc.timer = opt.timeout / 5;
+    cc.compress = opt.compress;
+    timer = (uint64_t) cc.timer * 1000;
+
+    sessions = xmalloc (opt.sessions * sizeof (*sessions));
+    memset (sessions, 0, opt.sessions * sizeof (*sessions));
+
+    stub_clock = t0 = mono_usec ();
+    next_arrival = t0;
+    next_timer = t0 + timer;
+    next_report = t0 + 1000000;
+    server_sample (&cpu0, &rss_peak);
+    own_cpu = clock ();
+
+    while (!stop && (started < opt.sessions || live)
+           && stub_clock - t0 < opt.limit) {
+        uint64_t due;
+
+        while (started < opt.sessions && live < opt.concurrent
+               && next_arrival <= stub_clock) {
+            session_start (&sessions[started]);
+            if (opt.rate > 0)
+                next_arrival += -log (1 - rng_unit ()) / opt.rate * 1e6;
+        }
+
+        due = next_timer;
+        if (started < opt.sessions && live < opt.concurrent && next_arrival < due)
+            due = next_arrival;
+        n = epoll_wait (ep, evs, 256,
+                        due > stub_clock ? (due - stub_clock + 999) / 1000 : 0);
+        if (n < 0 && errno != EINTR) {
+            perror ("epoll_wait");
+            exit (1);
+        }
+        stub_clock = mono_usec ();
+
+        for (i = 0; i < n; i++) {
+            const char *kind = evs[i].data.ptr;
+            if (*kind == EP_LISTEN)
+                sink_accept (lfd);
+            else if (*kind == EP_SINK)
+                sink_read (evs[i].data.ptr);
+            else if (((struct session *) kind)->live)
+                session_recv (evs[i].data.ptr);
+        }
+
+        if (stub_clock >= next_timer) {
+            struct session *s, *ns;
+            rel_timer ();
+            for (s = live_list; s; s = ns) {
+                ns = s->next;
+                pump (s);
+                reap (s);
+            }
+            next_timer = stub_clock + timer;
+        }
+
+        if (stub_clock >= next_report) {
+            server_sample (&cpu1, &rss);
+            if (rss > rss_peak)
+                rss_peak = rss;
+            if (opt.verbose)
+                fprintf (stderr, "%6.1f s  started %ld live %ld done %ld failed %ld"
+                         "  sink open %ld %.1f MB  server rss %.1f MB\n",
+                         (stub_clock - t0) / 1e6, started, live, completed,
+                         failed, sink_open, sink_bytes / 1e6, rss / 1e6);
+            next_report += 1000000;
+        }
+    }
+    t_end = stub_clock;
+    own_cpu = clock () - own_cpu;
+    server_sample (&cpu1, &rss);
+    if (rss > rss_peak)
+        rss_peak = rss;
+    secs = (t_end - t0) / 1e6;
+
+    printf ("sessions %ld size %lu", opt.sessions, (unsigned long) opt.size);
+    if (opt.size_max > opt.size)
+        printf ("-%lu", (unsigned long) opt.size_max);
+    printf (" concurrent %ld rate %g/s lifetime %gs window %d timeout %d\n",
+            opt.concurrent, opt.rate, opt.lifetime / 1e6, opt.window, opt.timeout);
+    printf ("started %ld, completed %ld, failed %ld, still open %ld, %.3f s\n",
+            started, completed, failed, live, secs);
+    printf ("setup: %ld sessions, %.1f/s\n", established,
+            last_setup > first_start ? established * 1e6 / (last_setup - first_start) : 0);
+    hist_print (stdout, "", "setup", &setup);
+    printf ("goodput: %lu bytes to the sink, %.3f MB/s, %ld connections"
+            " (%ld open), corrupt %lu\n",
+            (unsigned long) sink_bytes, secs > 0 ? sink_bytes / secs / 1e6 : 0,
+            sink_done, sink_open, (unsigned long) sink_corrupt);
+    if (nrates) {
+        for (i = 0; i < nrates; i++) {
+            sum += rates[i];
+            sum2 += rates[i] * rates[i];
+        }
+        qsort (rates, nrates, sizeof (*rates), cmp_double);
+        printf ("fairness: jain %.3f over %ld connections, kB/s min %.1f"
+                " p10 %.1f p50 %.1f p90 %.1f max %.1f\n",
+                sum * sum / (nrates * sum2), nrates, rates[0] / 1e3,
+                rates[nrates / 10] / 1e3, rates[nrates / 2] / 1e3,
+                rates[nrates - 1 - nrates / 10] / 1e3, rates[nrates - 1] / 1e3);
+    }
+    if (opt.npids)
+        printf ("server: cpu %.2f s (%.2f cores), rss %.1f MB, peak %.1f MB\n",
+                cpu1 - cpu0, secs > 0 ? (cpu1 - cpu0) / secs : 0,
+                rss / 1e6, rss_peak / 1e6);
+    printf ("load: cpu %.2f s\n", (double) own_cpu / CLOCKS_PER_SEC);
+    rel_dump_stats (NULL, stdout);
+    return completed == opt.sessions && !sink_corrupt ? 0 : 1;
+}
@@ -0,0 +1,338 @@
+/* Lossy link emulator for benchmarking reliable on one host.
+
+   lossy relays UDP datagrams between two endpoints and degrades the
+   link on the way: loss, reordering, duplication, corruption, delay,
+   jitter and a bandwidth cap, all driven by a seeded PRNG so runs are
+   reproducible.
+
+   Endpoint A talks to port-a, endpoint B talks to port-b:
+
+     reliable 7001 localhost:7101      (A)
+     reliable 7002 localhost:7102      (B)
+     lossy -l 2 7101 7102 localhost:7001 localhost:7002
+
+   On SIGINT/SIGTERM, or after -i seconds without traffic, lossy
+   prints per-direction counters to stderr and exits.
+
+   lossy -G bytes writes a reproducible payload of that many bytes
+   (seeded by -s) to stdout and exits.
+
+   Build: cc -O2 -pthread -DRLIB_NO_MAIN=1 -o lossy bench/lossy.c \
+              rlib.c reliable.c stats.c lz.c ring.c logq.c pipeline.c  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <getopt.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "../rlib.h"
+
+struct link {
+    double loss;			/* probabilities, 0..1 */
+    double reorder;
+    double dup;
+    double corrupt;
+    uint64_t delay;		/* usec */
+    uint64_t jitter;		/* usec, uniform +- */
+    uint64_t reorder_gap;		/* extra hold for reordered packets */
+    uint64_t bw;			/* bytes per second, 0 = unlimited */
+    size_t qlimit;		/* max packets queued per direction */
+};
+
+struct dir {
+    const char *name;
+    int in;			/* socket packets arrive on */
+    int out;			/* socket packets leave from */
+    struct sockaddr_storage dest;
+    uint64_t busy_until;		/* bandwidth cap: link idle after this */
+    size_t queued;
+
+    unsigned long pkts, acks, data, bytes;
+    unsigned long lost, dups, corrupted, reordered, qdrops, sent;
+    uint32_t max_seqno;
+};
+
+struct ev {
+    uint64_t due;
+    struct dir *d;
+    size_t len;
+    char buf[sizeof (packet_t)];
+};
+
+static struct link lk = { .reorder_gap = 10000, .qlimit = 10000 };
+static struct ev **heap;
+static size_t nheap, heapsize;
+static uint64_t rng_state = 88172645463325252ULL;
+static volatile sig_atomic_t stop;
+
+static uint64_t
+rng (void)
+{
+    /* xorshift64* */
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ULL;
+}
+
+static double
+rng_unit (void)
+{
+    return (rng () >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static void
+heap_push (struct ev *e)
+{
+    size_t i;
+
+    if (nheap == heapsize) {
+        heapsize = heapsize ? 2 * heapsize : 256;
+        heap = realloc (heap, heapsize * sizeof (*heap));
+        if (!heap) {
+            perror ("realloc");
+            exit (1);
+        }
+    }
+    for (i = nheap++; i > 0 && heap[(i - 1) / 2]->due > e->due; i = (i - 1) / 2)
+        heap[i] = heap[(i - 1) / 2];
+    heap[i] = e;
+}
+
+static struct ev *
+heap_pop (void)
+{
+    struct ev *top = heap[0], *last = heap[--nheap];
+    size_t i = 0, c;
+
+    while ((c = 2 * i + 1) < nheap) {
+        if (c + 1 < nheap && heap[c + 1]->due < heap[c]->due)
+            c++;
+        if (last->due <= heap[c]->due)
+            break;
+        heap[i] = heap[c];
+        i = c;
+    }
+    if (nheap)
+        heap[i] = last;
+    return top;
+}
+
+static void
+schedule (struct dir *d, const char *buf, size_t len, uint64_t now)
+{
+    struct ev *e;
+    uint64_t due = now + lk.delay;
+
+    if (d->queued >= lk.qlimit) {
+        d->qdrops++;
+        return;
+    }
+    if (lk.jitter) {
+        uint64_t j = rng () % (2 * lk.jitter + 1);
+        due = due + j > lk.jitter ? due + j - lk.jitter : now;
+    }
+    if (lk.bw) {
+        uint64_t start = d->busy_until > due ? d->busy_until : due;
+        d->busy_until = start + (uint64_t) len * 1000000 / lk.bw;
+        due = d->busy_until;
+    }
+    if (lk.reorder > 0 && rng_unit () < lk.reorder) {
+        due += lk.reorder_gap;
+        d->reordered++;
+    }
+
+    e = xmalloc (sizeof (*e));
+    e->due = due;
+    e->d = d;
+    e->len = len;
+    memcpy (e->buf, buf, len);
+    if (lk.corrupt > 0 && len && rng_unit () < lk.corrupt) {
+        e->buf[rng () % len] ^= 1 << (rng () % 8);
+        d->corrupted++;
+    }
+    d->queued++;
+    heap_push (e);
+}
+
+static void
+relay_in (struct dir *d, uint64_t now)
+{
+    char buf[sizeof (packet_t) + 64];
+    const packet_t *pkt = (const packet_t *) buf;
+    int n;
+
+    while ((n = recv (d->in, buf, sizeof (buf), 0)) >= 0) {
+        if (n > (int) sizeof (packet_t))
+            n = sizeof (packet_t);
+        d->pkts++;
+        d->bytes += n;
+        if (n == 8 || (n >= 8 && (ntohs (pkt->len) & (PKT_F_CREDIT|PKT_F_WINDOW))))
+            d->acks++;
+        else if (n >= 12) {
+            d->data++;
+            if (ntohl (pkt->seqno) > d->max_seqno)
+                d->max_seqno = ntohl (pkt->seqno);
+        }
+        if (lk.loss > 0 && rng_unit () < lk.loss) {
+            d->lost++;
+            continue;
+        }
+        schedule (d, buf, n, now);
+        if (lk.dup > 0 && rng_unit () < lk.dup) {
+            d->dups++;
+            schedule (d, buf, n, now);
+        }
+    }
+    /* ECONNREFUSED just means the far endpoint is not up (yet) */
+}
+
+static void
+print_dir (const struct dir *d)
+{
+    fprintf (stderr,
+             "%s: pkts %lu data %lu acks %lu bytes %lu max_seqno %u"
+             " lost %lu dup %lu corrupt %lu reorder %lu qdrop %lu sent %lu\n",
+             d->name, d->pkts, d->data, d->acks, d->bytes, d->max_seqno,
+             d->lost, d->dups, d->corrupted, d->reordered, d->qdrops, d->sent);
+}
+
+static void
+stop_handler (int sig)
+{
+    stop = 1;
+}
+
+static void
+gen_payload (unsigned long n)
+{
+    char buf[4096];
+    size_t i;
+
+    while (n) {
+        size_t len = n < sizeof (buf) ? n : sizeof (buf);
+        for (i = 0; i < len; i++)
+            buf[i] = rng () >> 56;
+        if (fwrite (buf, 1, len, stdout) != len) {
+            perror ("write");
+            exit (1);
+        }
+        n -= len;
+    }
+    exit (0);
+}
+
+static void
+usage (void)
+{
+    fprintf (stderr,
+             "usage: %s [-l loss%%] [-r reorder%%] [-D dup%%] [-c corrupt%%]\n"
+             "          [-d delay-ms] [-j jitter-ms] [-g gap-ms] [-b kbit/s]\n"
+             "          [-q queue-pkts] [-s seed] [-i idle-s]\n"
+             "          port-a port-b [host:]port-of-A [host:]port-of-B\n"
+             "       %s [-s seed] -G bytes\n", progname, progname);
+    exit (1);
+}
+
+int
+main (int argc, char **argv)
+{
+    struct dir ab = { .name = "a->b" }, ba = { .name = "b->a" };
+    struct sockaddr_storage sa, sb;
+    struct pollfd pfd[2];
+    struct sigaction act;
+    long idle = 0, gen = -1;
+    uint64_t last_pkt;
+    int opt;
+
+    progname = "lossy";
+    while ((opt = getopt (argc, argv, "l:r:D:c:d:j:g:b:q:s:i:G:")) != -1)
+        switch (opt) {
+        case 'l': lk.loss = atof (optarg) / 100; break;
+        case 'r': lk.reorder = atof (optarg) / 100; break;
+        case 'D': lk.dup = atof (optarg) / 100; break;
+        case 'c': lk.corrupt = atof (optarg) / 100; break;
+        case 'd': lk.delay = atof (optarg) * 1000; break;
+        case 'j': lk.jitter = atof (optarg) * 1000; break;
+        case 'g': lk.reorder_gap = atof (optarg) * 1000; break;
+        case 'b': lk.bw = atof (optarg) * 1000 / 8; break;
+        case 'q': lk.qlimit = atol (optarg); break;
+        case 's': rng_state ^= strtoull (optarg, NULL, 0) * 0x9E3779B97F4A7C15ULL;
+                  if (!rng_state) rng_state = 1;
+                  break;
+        case 'i': idle = atol (optarg); break;
+        case 'G': gen = atol (optarg); break;
+        default: usage ();
+        }
+    if (gen >= 0)
+        gen_payload (gen);
+    if (optind + 4 != argc)
+        usage ();
+
+    if (get_address (&sa, 1, 1, AF_INET, argv[optind]) < 0
+        || get_address (&sb, 1, 1, AF_INET, argv[optind + 1]) < 0
+        || get_address (&ab.dest, 0, 1, AF_INET, argv[optind + 3]) < 0
+        || get_address (&ba.dest, 0, 1, AF_INET, argv[optind + 2]) < 0
+        || (ab.in = listen_on (1, &sa)) < 0
+        || (ba.in = listen_on (1, &sb)) < 0)
+        exit (1);
+    /* Replies to A must come from port-a, replies to B from port-b */
+    ab.out = ba.in;
+    ba.out = ab.in;
+    make_async (ab.in);
+    make_async (ba.in);
+
+    memset (&act, 0, sizeof (act));
+    act.sa_handler = stop_handler;
+    sigaction (SIGINT, &act, NULL);
+    sigaction (SIGTERM, &act, NULL);
+
+    pfd[0].fd = ab.in;
+    pfd[1].fd = ba.in;
+    pfd[0].events = pfd[1].events = POLLIN;
+    last_pkt = now_usec ();
+
+    while (!stop) {
+        uint64_t now = now_usec ();
+        int to = idle ? 1000 : -1;
+
+        while (nheap && heap[0]->due <= now) {
+            struct ev *e = heap_pop ();
+            struct dir *d = e->d;
+            if (sendto (d->out, e->buf, e->len, 0,
+                        (struct sockaddr *) &d->dest, addrsize (&d->dest)) >= 0)
+                d->sent++;
+            d->queued--;
+            free (e);
+        }
+        if (nheap)
+            to = (heap[0]->due - now + 999) / 1000;
+        if (idle && now - last_pkt > (uint64_t) idle * 1000000)
+            break;
+
+        if (poll (pfd, 2, to) < 0) {
+            if (errno != EINTR)
+                perror ("poll");
+            continue;
+        }
+        now = now_usec ();
+        if (pfd[0].revents) {
+            relay_in (&ab, now);
+            last_pkt = now;
+        }
+        if (pfd[1].revents) {
+            relay_in (&ba, now);
+            last_pkt = now;
+        }
+    }
+
+    print_dir (&ab);
+    print_dir (&ba);
+    return 0;
+}
@@ -0,0 +1,333 @@
+/* Microbenchmarks for the per-packet protocol paths.
+
+   reliable.c is linked against the in-memory connection layer in
+   bench/stub.c, so the numbers contain no kernel or socket cost.
+   Reported are wall-clock ns per packet and payload bytes per CPU
+   cycle (TSC, x86 only) for
+
+     cksum      cksum() over a full 512 byte packet
+     send       rel_read() filling and sending a packet + its ack
+                through rel_recvpkt()
+     recv       rel_recvpkt() + rel_output() of data packets that
+                arrive in order, reordered within the window, or with
+                1% loss repaired by a go-back-N style resend
+     timer      rel_timer() over a full window, with nothing due
+                (scan) and with every packet due (retransmit)
+
+   usage: micro [-n packets] [-w window,window,...]
+
+   Build: cc -O2 -DRLIB_UTIL_ONLY=1 -o micro bench/micro.c bench/stub.c \
+              rlib.c reliable.c stats.c lz.c  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#if defined(__x86_64__) || defined(__i386__)
+# include <x86intrin.h>
+# define HAVE_TSC 1
+#endif
+
+#include "stub.h"
+
+enum pattern { IN_ORDER, REORDERED, LOSSY };
+static const char *pattern_name[] = { "in-order", "reordered", "lossy" };
+
+static long npkts = 200000;
+static int timeout = 100;	/* ms; the backoff stops at 8 times it */
+static char payload[500];
+
+static uint64_t
+wall_ns (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t
+cycles (void)
+{
+#if HAVE_TSC
+    return __rdtsc ();
+#else
+    return 0;
+#endif
+}
+
+struct meter {
+    uint64_t ns, cyc;
+};
+
+static void
+meter_start (struct meter *m)
+{
+    m->ns = wall_ns ();
+    m->cyc = cycles ();
+}
+
+static void
+meter_report (struct meter *m, const char *bench, int window,
+              const char *pattern, long pkts, uint64_t bytes)
+{
+    uint64_t ns = wall_ns () - m->ns;
+    uint64_t cyc = cycles () - m->cyc;
+
+    if (window)
+        printf ("%-8s %7d  %-10s %10.1f", bench, window, pattern,
+                (double) ns / pkts);
+    else
+        printf ("%-8s %7s  %-10s %10.1f", bench, "-", pattern,
+                (double) ns / pkts);
+    if (cyc && bytes)
+        printf (" %12.3f\n", (double) bytes / cyc);
+    else
+        printf (" %12s\n", "-");
+}
+
+static conn_t *
+new_conn (int window)
+{
+    struct config_common cc;
+    conn_t *c = stub_conn ();
+
+    memset (&cc, 0, sizeof (cc));
+    cc.window = window;
+    cc.timeout = timeout;
+    cc.timer = cc.timeout / 5;
+    c->rel = rel_create (c, NULL, &cc);
+    return c;
+}
+
+static void
+free_conn (conn_t *c)
+{
+    rel_destroy (c->rel);
+    stub_conn_free (c);
+}
+
+static void
+make_data (packet_t *pkt, uint32_t seqno, uint32_t ackno)
+{
+    pkt->cksum = 0;
+    pkt->len = htons (sizeof (payload) + 12);
+    pkt->ackno = htonl (ackno);
+    pkt->seqno = htonl (seqno);
+    memcpy (pkt->data, payload, sizeof (payload));
+    pkt->cksum = cksum (pkt, sizeof (payload) + 12);
+}
+
+static void
+make_ack (struct ack_packet *pkt, uint32_t ackno)
+{
+    pkt->cksum = 0;
+    pkt->len = htons (8);
+    pkt->ackno = htonl (ackno);
+    pkt->cksum = cksum (pkt, 8);
+}
+
+static int
+full_input (conn_t *c, void *buf, size_t len)
+{
+    if (len > sizeof (payload))
+        len = sizeof (payload);
+    memcpy (buf, payload, len);
+    return len;
+}
+
+static void
+bench_cksum (void)
+{
+    static char buf[512];
+    volatile uint16_t sink = 0;
+    struct meter m;
+    long i;
+
+    memset (buf, 0x5a, sizeof (buf));
+    meter_start (&m);
+    for (i = 0; i < npkts; i++) {
+        buf[i & 511] = i;
+        sink += cksum (buf, sizeof (buf));
+    }
+    meter_report (&m, "cksum", 0, "-", npkts, (uint64_t) npkts * sizeof (buf));
+    (void) sink;
+}
+
+/* Fill and send one packet, then ack it. */
+static void
+bench_send (int window)
+{
+    struct ack_packet *acks = xmalloc (npkts * sizeof (*acks));
+    conn_t *c = new_conn (window);
+    struct ack_packet ack;
+    struct meter m;
+    long i;
+
+    for (i = 0; i < npkts; i++)
+        make_ack (&acks[i], i + 2);
+    c->input = full_input;
+
+    meter_start (&m);
+    for (i = 0; i < npkts; i++) {
+        rel_read (c->rel);
+        ack = acks[i];
+        rel_recvpkt (c->rel, (packet_t *) &ack, sizeof (ack));
+    }
+    meter_report (&m, "send", window, "in-order", npkts,
+                  (uint64_t) npkts * sizeof (payload));
+
+    free_conn (c);
+    free (acks);
+}
+
+/* Order in which the receiver sees seqnos 1..npkts, with resends. */
+static uint32_t *
+arrival_order (enum pattern p, int window, long *n)
+{
+    uint32_t *order = xmalloc (2 * npkts * sizeof (*order));
+    long i, k = 0;
+
+    for (i = 0; i < npkts; i += window) {
+        long end = i + window < npkts ? i + window : npkts;
+        long j, lost = -1;
+
+        switch (p) {
+        case IN_ORDER:
+            for (j = i; j < end; j++)
+                order[k++] = j + 1;
+            break;
+        case REORDERED:
+            for (j = end - 1; j >= i; j--)
+                order[k++] = j + 1;
+            break;
+        case LOSSY:
+            /* Every 100th packet is lost; the sender then resends it
+               and everything after it in the window. */
+            for (j = i; j < end; j++) {
+                if ((j + 1) % 100 == 0 && lost < 0)
+                    lost = j;
+                else
+                    order[k++] = j + 1;
+            }
+            if (lost >= 0)
+                for (j = lost; j < end; j++)
+                    order[k++] = j + 1;
+            break;
+        }
+    }
+    *n = k;
+    return order;
+}
+
+static void
+bench_recv (int window, enum pattern p)
+{
+    packet_t *pkts = xmalloc (npkts * sizeof (*pkts));
+    conn_t *c = new_conn (window);
+    uint32_t *order;
+    packet_t pkt;
+    struct meter m;
+    long i, n;
+
+    for (i = 0; i < npkts; i++)
+        make_data (&pkts[i], i + 1, 1);
+    order = arrival_order (p, window, &n);
+
+    meter_start (&m);
+    for (i = 0; i < n; i++) {
+        memcpy (&pkt, &pkts[order[i] - 1], sizeof (pkt));
+        rel_recvpkt (c->rel, &pkt, sizeof (payload) + 12);
+    }
+    meter_report (&m, "recv", window, pattern_name[p], n,
+                  (uint64_t) npkts * sizeof (payload));
+    if (c->bytes_out != (uint64_t) npkts * sizeof (payload))
+        fprintf (stderr, "recv: delivered %lu of %lu bytes\n",
+                 (unsigned long) c->bytes_out,
+                 (unsigned long) (npkts * sizeof (payload)));
+
+    free_conn (c);
+    free (order);
+    free (pkts);
+}
+
+static void
+bench_timer (int window, int due)
+{
+    conn_t *c = new_conn (window);
+    long i, calls = npkts / window + 1;
+    uint64_t sent;
+    struct meter m;
+
+    c->input = full_input;
+    for (i = 0; i < window; i++)
+        rel_read (c->rel);
+
+    /* step past the longest backed-off timeout, so every call resends
+       the whole window */
+    sent = c->pkts_sent;
+    meter_start (&m);
+    for (i = 0; i < calls; i++) {
+        if (due)
+            stub_clock += 8 * timeout * 1000;
+        rel_timer ();
+    }
+    sent = c->pkts_sent - sent;
+    meter_report (&m, "timer", window, due ? "retransmit" : "scan",
+                  due ? (long) sent : calls,
+                  due ? sent * sizeof (payload) : 0);
+
+    free_conn (c);
+}
+
+static void
+usage (void)
+{
+    fprintf (stderr, "usage: %s [-n packets] [-w window,window,...]\n",
+             progname);
+    exit (1);
+}
+
+int
+main (int argc, char **argv)
+{
+    char *windows = "1,8,64,256";
+    char *w;
+    int opt;
+
+    progname = "micro";
+    while ((opt = getopt (argc, argv, "n:w:")) != -1)
+        switch (opt) {
+        case 'n':
+            npkts = atol (optarg);
+            break;
+        case 'w':
+            windows = optarg;
+            break;
+        default:
+            usage ();
+        }
+    if (npkts < 1)
+        usage ();
+
+    for (int i = 0; i < (int) sizeof (payload); i++)
+        payload[i] = i * 7;
+
+    printf ("%-8s %7s  %-10s %10s %12s\n",
+            "bench", "window", "pattern", "ns/pkt", "bytes/cycle");
+    bench_cksum ();
+    windows = strdup (windows);
+    while ((w = strsep (&windows, ","))) {
+        int window = atoi (w);
+        if (window < 1)
+            usage ();
+        bench_send (window);
+        bench_recv (window, IN_ORDER);
+        bench_recv (window, REORDERED);
+        bench_recv (window, LOSSY);
+        bench_timer (window, 0);
+        bench_timer (window, 1);
+    }
+    return 0;
+}
@@ -0,0 +1,271 @@
+/* Replays a trace recorded with reliable -x.
+
+   reliable.c runs against the in-memory connection layer in
+   bench/stub.c.  The trace's datagrams, rel_read, rel_output and
+   rel_timer calls are made in their order, as fast as they go, with
+   now_usec() at the time each had in the recording; conn_input and
+   conn_bufspace give back what they gave then.  So a trace of a
+   connection that saw loss or reordering runs the same way every
+   time, and can be timed.
+
+   Reported per run are the time, calls and datagrams per second, and
+   output bytes per second.  The output is checked against the hash
+   at the end of the trace, and the datagrams sent against the count
+   there.  Should the replay take a different path than the recording
+   (e.g. after a change to reliable.c), answers that do not line up
+   are counted as divergences, and conn_input and conn_bufspace fall
+   back to nothing and 8192.
+
+   usage: replay [-n runs] [-o file] trace
+
+     -o file  write the output of the first run to file
+
+   Exits 1 if any run's output or send count differs from the
+   recording.
+
+   Build: cc -O2 -DRLIB_UTIL_ONLY=1 -o replay bench/replay.c bench/stub.c \
+              rlib.c reliable.c stats.c lz.c  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+
+#include "stub.h"
+#include "../trace.h"
+
+static char *trace_buf;
+static size_t trace_len;
+static size_t pos;			/* next record */
+static struct trace_end end;
+
+static FILE *out;
+static uint64_t out_hash, out_bytes, divergences;
+
+static uint64_t
+wall_ns (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* The record at pos, or NULL at the end of the trace */
+static const struct trace_rec *
+peek (void)
+{
+    const struct trace_rec *h = (const struct trace_rec *) (trace_buf + pos);
+
+    if (pos + sizeof (*h) > trace_len
+            || pos + sizeof (*h) + h->len > trace_len)
+        return NULL;
+    return h;
+}
+
+static void
+next (void)
+{
+    pos += sizeof (struct trace_rec) + peek ()->len;
+}
+
+static int
+replay_input (conn_t *c, void *buf, size_t n)
+{
+    const struct trace_rec *h = peek ();
+    size_t len;
+
+    if (h && h->type == TRACE_INPUT_EOF) {
+        next ();
+        return -1;
+    }
+    if (!h || h->type != TRACE_INPUT) {
+        divergences++;
+        return 0;
+    }
+    len = h->len;
+    if (len > n) {
+        divergences++;
+        len = n;
+    }
+    memcpy (buf, h + 1, len);
+    next ();
+    return len;
+}
+
+static size_t
+replay_bufspace (conn_t *c)
+{
+    const struct trace_rec *h = peek ();
+    uint64_t space;
+
+    if (!h || h->type != TRACE_BUFSPACE || h->len != sizeof (space)) {
+        divergences++;
+        return 8192;
+    }
+    memcpy (&space, h + 1, sizeof (space));
+    next ();
+    return space;
+}
+
+static int
+replay_output (conn_t *c, const void *buf, size_t n)
+{
+    out_hash = trace_hash (out_hash, buf, n);
+    out_bytes += n;
+    if (out)
+        fwrite (buf, 1, n, out);
+    return n;
+}
+
+static void
+load (const char *name, struct trace_config *tc)
+{
+    FILE *f = fopen (name, "rb");
+    const struct trace_rec *h;
+    size_t cap = 1 << 20, n;
+
+    if (!f) {
+        perror (name);
+        exit (1);
+    }
+    trace_buf = xmalloc (cap);
+    while ((n = fread (trace_buf + trace_len, 1, cap - trace_len, f)) > 0)
+        if ((trace_len += n) == cap) {
+            cap *= 2;
+            if (!(trace_buf = realloc (trace_buf, cap))) {
+                perror ("realloc");
+                exit (1);
+            }
+        }
+    fclose (f);
+
+    pos = 0;
+    if (!(h = peek ()) || h->type != TRACE_CONFIG || h->len != sizeof (*tc)) {
+        fprintf (stderr, "%s: not a trace\n", name);
+        exit (1);
+    }
+    memcpy (tc, h + 1, sizeof (*tc));
+    if (tc->magic != TRACE_MAGIC || tc->version != TRACE_VERSION) {
+        fprintf (stderr, "%s: not a trace of this version\n", name);
+        exit (1);
+    }
+    for (next (); (h = peek ()); next ())
+        if (h->type == TRACE_END && h->len == sizeof (end))
+            memcpy (&end, h + 1, sizeof (end));
+    if (!end.hash)
+        fprintf (stderr, "%s: trace has no end, output is not checked\n", name);
+}
+
+/* One pass over the trace; returns whether the output matched */
+static int
+run (const struct trace_config *tc)
+{
+    const struct trace_rec *h;
+    uint64_t calls = 0, pkts = 0, sends, t0, ns;
+    int same;
+    conn_t *c = stub_conn ();
+    rel_t *r;
+
+    c->input = replay_input;
+    c->bufspace = replay_bufspace;
+    c->output = replay_output;
+    out_hash = TRACE_HASH_INIT;
+    out_bytes = 0;
+    divergences = 0;
+
+    pos = 0;
+    next ();
+    stub_clock = (h = peek ()) ? h->usec : 0;
+    t0 = wall_ns ();
+    r = rel_create (c, NULL, &tc->cc);
+    while ((h = peek ()) && h->type != TRACE_END && !c->destroyed) {
+        packet_t pkt;
+
+        stub_clock = h->usec;
+        switch (h->type) {
+        case TRACE_PKT:
+            memcpy (&pkt, h + 1, h->len < sizeof (pkt) ? h->len : sizeof (pkt));
+            next ();
+            rel_recvpkt (r, &pkt, h->len);
+            pkts++;
+            break;
+        case TRACE_READ:
+            next ();
+            rel_read (r);
+            break;
+        case TRACE_OUTPUT:
+            next ();
+            rel_output (r);
+            break;
+        case TRACE_TIMER:
+            next ();
+            rel_timer ();
+            break;
+        default:
+            /* An answer nobody asked for this time */
+            next ();
+            divergences++;
+            continue;
+        }
+        calls++;
+    }
+    ns = wall_ns () - t0;
+    sends = c->pkts_sent;
+    if (!c->destroyed)
+        rel_destroy (r);
+    stub_conn_free (c);
+
+    /* The same bytes out, and the same datagrams sent to get them there */
+    same = out_hash == end.hash && out_bytes == end.bytes_out && sends == end.sends;
+    printf ("%8.3f ms  %6.2f Mcalls/s  %6.2f Mpkts/s  %8.1f MB/s  "
+            "calls=%lu pkts=%lu sends=%lu/%lu out=%lu/%lu divergences=%lu %s\n",
+            ns / 1e6, ns ? calls * 1e3 / ns : 0, ns ? pkts * 1e3 / ns : 0,
+            ns ? out_bytes * 1e3 / ns : 0,
+            (unsigned long) calls, (unsigned long) pkts,
+            (unsigned long) sends, (unsigned long) end.sends,
+            (unsigned long) out_bytes, (unsigned long) end.bytes_out,
+            (unsigned long) divergences,
+            !end.hash ? "unchecked" : same ? "SAME" : "DIFFERENT");
+    return !end.hash || same;
+}
+
+int
+main (int argc, char **argv)
+{
+    struct trace_config tc;
+    int runs = 1, ok = 1, opt, i;
+    char *out_name = NULL;
+
+    while ((opt = getopt (argc, argv, "n:o:")) != -1)
+        switch (opt) {
+        case 'n':
+            runs = atoi (optarg);
+            break;
+        case 'o':
+            out_name = optarg;
+            break;
+        default:
+            goto usage;
+        }
+    if (optind != argc - 1 || runs < 1) {
+    usage:
+        fprintf (stderr, "usage: %s [-n runs] [-o file] trace\n", argv[0]);
+        return 1;
+    }
+
+    load (argv[optind], &tc);
+    for (i = 0; i < runs; i++) {
+        if (i == 0 && out_name && !(out = fopen (out_name, "wb"))) {
+            perror (out_name);
+            return 1;
+        }
+        ok &= run (&tc);
+        if (out) {
+            fclose (out);
+            out = NULL;
+        }
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,443 @@
+/* Deterministic simulation of many reliable connections.
+
+   reliable.c runs unchanged against the in-memory connection layer in
+   bench/stub.c.  Time is virtual: an event queue orders packet
+   deliveries, connection starts and the rel_timer() ticks that rlib
+   would fire every timeout/5 ms, and now_usec() returns the time of
+   the event being processed.  Links are lossy, delayed and bandwidth
+   capped per direction.  Everything random comes from one seed, so a
+   run is reproducible bit for bit.
+
+   Each pair is two endpoints A and B; A sends -s bytes to B (and B
+   as many to A with -B), the receiving side checks every byte.
+   A pair is complete once B has written all of A's bytes and its
+   EOF; an EOF that comes early counts as truncated.
+
+   usage: sim [-n pairs] [-s bytes] [-B] [-w window] [-t timeout-ms]
+              [-a arrival-spread-s] [-l loss%] [-D dup%] [-r reorder%]
+              [-d delay-ms] [-j jitter-ms] [-b kbit/s] [-S seed]
+              [-T limit-s] [-v]
+
+   Build: cc -O2 -DRLIB_UTIL_ONLY=1 -o sim bench/sim.c bench/stub.c \
+              rlib.c reliable.c stats.c lz.c  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+
+#include "stub.h"
+#include "../stats.h"
+
+enum ev_type { EV_START, EV_PACKET, EV_TIMER };
+
+struct pair;
+
+struct endpoint {
+    conn_t *c;
+    struct endpoint *peer;
+    struct pair *pair;
+    char name;			/* 'A' or 'B' */
+    char live;			/* rel not destroyed yet */
+    char eof_given;		/* conn_input returned -1 */
+    uint64_t in_size;		/* bytes this side sends */
+    uint64_t in_off;		/* bytes handed to conn_input */
+    uint64_t out_off;		/* bytes received and checked */
+    uint64_t busy_until;		/* bandwidth cap of the outgoing link */
+};
+
+struct pair {
+    int id;
+    uint64_t start;
+    uint64_t done;		/* 0 until B wrote A's EOF */
+    struct endpoint a, b;
+};
+
+struct ev {
+    uint64_t due;
+    uint64_t seq;			/* tie breaker, keeps runs deterministic */
+    enum ev_type type;
+    struct pair *pair;
+    struct endpoint *to;
+    size_t len;
+    packet_t pkt;
+};
+
+static struct {
+    long pairs;
+    uint64_t size;
+    int both;
+    int window;
+    int timeout;
+    int fec;
+    int compress;
+    int mem_limit;		/* kbytes */
+    double spread;		/* seconds */
+    double loss, dup, reorder;
+    uint64_t delay, jitter, gap;	/* usec */
+    uint64_t bw;			/* bytes/s, 0 = unlimited */
+    uint64_t limit;		/* usec */
+    int verbose;
+} opt = {
+    .pairs = 1000, .size = 100000, .window = 8, .timeout = 100,
+    .delay = 20000, .gap = 10000, .limit = 3600ULL * 1000000,
+};
+
+static struct ev **heap;
+static size_t nheap, heapsize;
+static uint64_t evseq, nevents;
+static uint64_t rng_state = 88172645463325252ULL;
+static long live, unstarted, completed, corrupt, truncated;
+static struct hist completion;
+
+static uint64_t
+rng (void)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ULL;
+}
+
+static double
+rng_unit (void)
+{
+    return (rng () >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static int
+ev_before (const struct ev *a, const struct ev *b)
+{
+    return a->due < b->due || (a->due == b->due && a->seq < b->seq);
+}
+
+static void
+heap_push (struct ev *e)
+{
+    size_t i;
+
+    e->seq = evseq++;
+    if (nheap == heapsize) {
+        heapsize = heapsize ? 2 * heapsize : 1024;
+        heap = realloc (heap, heapsize * sizeof (*heap));
+        if (!heap) {
+            perror ("realloc");
+            exit (1);
+        }
+    }
+    for (i = nheap++; i > 0 && ev_before (e, heap[(i - 1) / 2]); i = (i - 1) / 2)
+        heap[i] = heap[(i - 1) / 2];
+    heap[i] = e;
+}
+
+static struct ev *
+heap_pop (void)
+{
+    struct ev *top = heap[0], *last = heap[--nheap];
+    size_t i = 0, c;
+
+    while ((c = 2 * i + 1) < nheap) {
+        if (c + 1 < nheap && ev_before (heap[c + 1], heap[c]))
+            c++;
+        if (!ev_before (heap[c], last))
+            break;
+        heap[i] = heap[c];
+        i = c;
+    }
+    if (nheap)
+        heap[i] = last;
+    return top;
+}
+
+static struct ev *
+ev_new (enum ev_type type, uint64_t due)
+{
+    struct ev *e = xmalloc (sizeof (*e));
+    e->type = type;
+    e->due = due;
+    e->pair = NULL;
+    e->to = NULL;
+    e->len = 0;
+    return e;
+}
+
+static inline unsigned char
+pattern (const struct endpoint *from, uint64_t off)
+{
+    return (off * 131 + (off >> 9) + from->pair->id * 7 + from->name) & 0xff;
+}
+
+/* Put a packet on the link from ep to its peer. */
+static void
+link_send (conn_t *c, const packet_t *pkt, size_t len)
+{
+    struct endpoint *ep = c->arg;
+    int copies = 1;
+
+    if (opt.loss > 0 && rng_unit () < opt.loss)
+        return;
+    if (opt.dup > 0 && rng_unit () < opt.dup)
+        copies = 2;
+
+    while (copies--) {
+        uint64_t due = stub_clock + opt.delay;
+        struct ev *e;
+
+        if (opt.jitter) {
+            uint64_t j = rng () % (2 * opt.jitter + 1);
+            due = due + j > opt.jitter ? due + j - opt.jitter : stub_clock;
+        }
+        if (opt.bw) {
+            uint64_t start = ep->busy_until > due ? ep->busy_until : due;
+            ep->busy_until = start + (uint64_t) len * 1000000 / opt.bw;
+            due = ep->busy_until;
+        }
+        if (opt.reorder > 0 && rng_unit () < opt.reorder)
+            due += opt.gap;
+
+        e = ev_new (EV_PACKET, due);
+        e->to = ep->peer;
+        e->len = len;
+        memcpy (&e->pkt, pkt, len);
+        heap_push (e);
+    }
+}
+
+static int
+gen_input (conn_t *c, void *buf, size_t len)
+{
+    struct endpoint *ep = c->arg;
+    unsigned char *p = buf;
+    size_t i;
+
+    if (ep->in_off == ep->in_size) {
+        ep->eof_given = 1;
+        return -1;
+    }
+    if (len > ep->in_size - ep->in_off)
+        len = ep->in_size - ep->in_off;
+    for (i = 0; i < len; i++)
+        p[i] = pattern (ep, ep->in_off + i);
+    ep->in_off += len;
+    return len;
+}
+
+static int
+check_output (conn_t *c, const void *buf, size_t len)
+{
+    struct endpoint *ep = c->arg;
+    const unsigned char *p = buf;
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        if (p[i] != pattern (ep->peer, ep->out_off + i)) {
+            if (opt.verbose)
+                fprintf (stderr, "pair %d %c: bad byte at %lu\n",
+                         ep->pair->id, ep->name,
+                         (unsigned long) (ep->out_off + i));
+            corrupt++;
+            break;
+        }
+    ep->out_off += len;
+    return len;
+}
+
+static void
+rel_gone (conn_t *c)
+{
+    struct endpoint *ep = c->arg;
+    ep->live = 0;
+    live--;
+}
+
+/* rlib calls rel_read whenever input is readable; our input always
+   is, so keep reading until the window is full or input is over. */
+static void
+pump (struct endpoint *ep)
+{
+    while (ep->live && !ep->eof_given) {
+        uint64_t off = ep->in_off;
+        rel_read (ep->c->rel);
+        if (ep->in_off == off && !ep->eof_given)
+            break;
+    }
+}
+
+static void
+endpoint_init (struct endpoint *ep, struct pair *p, char name,
+               struct endpoint *peer, uint64_t in_size)
+{
+    ep->pair = p;
+    ep->name = name;
+    ep->peer = peer;
+    ep->in_size = in_size;
+    ep->c = stub_conn ();
+    ep->c->arg = ep;
+    ep->c->send = link_send;
+    ep->c->input = gen_input;
+    ep->c->output = check_output;
+    ep->c->destroy = rel_gone;
+}
+
+static void
+pair_start (struct pair *p)
+{
+    struct config_common cc;
+
+    memset (&cc, 0, sizeof (cc));
+    cc.window = opt.window;
+    cc.timeout = opt.timeout;
+    cc.timer = opt.timeout / 5;
+    cc.fec = opt.fec;
+    cc.compress = opt.compress;
+    cc.mem_limit = opt.mem_limit;
+
+    p->start = stub_clock;
+    endpoint_init (&p->a, p, 'A', &p->b, opt.size);
+    endpoint_init (&p->b, p, 'B', &p->a, opt.both ? opt.size : 0);
+    p->a.c->rel = rel_create (p->a.c, NULL, &cc);
+    p->b.c->rel = rel_create (p->b.c, NULL, &cc);
+    p->a.live = p->b.live = 1;
+    live += 2;
+    unstarted--;
+    pump (&p->a);
+    pump (&p->b);
+}
+
+static void
+deliver (struct ev *e)
+{
+    struct endpoint *ep = e->to;
+    struct pair *p = ep->pair;
+
+    if (!ep->live) {
+        /* rlib: ICMP port unreachable, peer assumed dead */
+        if (ep->peer->live)
+            rel_destroy (ep->peer->c->rel);
+        return;
+    }
+    rel_recvpkt (ep->c->rel, &e->pkt, e->len);
+    if (!p->done && p->b.c->write_eof) {
+        p->done = stub_clock;
+        if (p->b.out_off != p->a.in_size) {
+            /* EOF before all of A's bytes came out */
+            if (opt.verbose)
+                fprintf (stderr, "pair %d B: EOF after %lu of %lu bytes\n",
+                         p->id, (unsigned long) p->b.out_off,
+                         (unsigned long) p->a.in_size);
+            truncated++;
+        } else {
+            hist_record (&completion, p->done - p->start);
+            completed++;
+        }
+    }
+    pump (ep);
+}
+
+static void
+usage (void)
+{
+    fprintf (stderr,
+             "usage: %s [-n pairs] [-s bytes] [-B] [-w window] [-t timeout-ms] [-F n|a] [-z] [-M kbytes]\n"
+             "          [-a arrival-spread-s] [-l loss%%] [-D dup%%] [-r reorder%%]\n"
+             "          [-d delay-ms] [-j jitter-ms] [-b kbit/s] [-S seed]\n"
+             "          [-T limit-s] [-v]\n", progname);
+    exit (1);
+}
+
+int
+main (int argc, char **argv)
+{
+    struct pair *pairs;
+    uint64_t timer;
+    clock_t cpu;
+    long i;
+    int o;
+
+    progname = "sim";
+    while ((o = getopt (argc, argv, "n:s:Bw:t:F:zM:a:l:D:r:d:j:b:S:T:v")) != -1)
+        switch (o) {
+        case 'n': opt.pairs = atol (optarg); break;
+        case 's': opt.size = strtoull (optarg, NULL, 0); break;
+        case 'B': opt.both = 1; break;
+        case 'w': opt.window = atoi (optarg); break;
+        case 't': opt.timeout = atoi (optarg); break;
+        case 'z': opt.compress = 1; break;
+        case 'M': opt.mem_limit = atoi (optarg); break;
+        case 'F': opt.fec = optarg[0] == 'a' ? FEC_ADAPTIVE : atoi (optarg); break;
+        case 'a': opt.spread = atof (optarg); break;
+        case 'l': opt.loss = atof (optarg) / 100; break;
+        case 'D': opt.dup = atof (optarg) / 100; break;
+        case 'r': opt.reorder = atof (optarg) / 100; break;
+        case 'd': opt.delay = atof (optarg) * 1000; break;
+        case 'j': opt.jitter = atof (optarg) * 1000; break;
+        case 'b': opt.bw = atof (optarg) * 1000 / 8; break;
+        case 'S': rng_state ^= strtoull (optarg, NULL, 0) * 0x9E3779B97F4A7C15ULL;
+                  if (!rng_state) rng_state = 1;
+                  break;
+        case 'T': opt.limit = atof (optarg) * 1000000; break;
+        case 'v': opt.verbose = 1; break;
+        default: usage ();
+        }
+    if (optind != argc || opt.pairs < 1 || opt.window < 1 || opt.timeout < 10)
+        usage ();
+
+    timer = (uint64_t) opt.timeout / 5 * 1000;
+    pairs = xmalloc (opt.pairs * sizeof (*pairs));
+    memset (pairs, 0, opt.pairs * sizeof (*pairs));
+    for (i = 0; i < opt.pairs; i++) {
+        struct ev *e = ev_new (EV_START, opt.spread * 1000000 * rng_unit ());
+        pairs[i].id = i;
+        e->pair = &pairs[i];
+        heap_push (e);
+    }
+    unstarted = opt.pairs;
+    heap_push (ev_new (EV_TIMER, timer));
+
+    cpu = clock ();
+    while (nheap && (live || unstarted)) {
+        struct ev *e = heap_pop ();
+
+        if (e->due > opt.limit) {
+            free (e);
+            break;
+        }
+        stub_clock = e->due;
+        nevents++;
+        switch (e->type) {
+        case EV_START:
+            pair_start (e->pair);
+            break;
+        case EV_PACKET:
+            deliver (e);
+            break;
+        case EV_TIMER:
+            rel_timer ();
+            for (i = 0; i < opt.pairs; i++) {
+                pump (&pairs[i].a);
+                pump (&pairs[i].b);
+            }
+            heap_push (ev_new (EV_TIMER, stub_clock + timer));
+            break;
+        }
+        free (e);
+    }
+    cpu = clock () - cpu;
+
+    printf ("pairs %ld size %lu%s window %d timeout %d spread %gs\n"
+            "link: loss %g%% dup %g%% reorder %g%% delay %gms jitter %gms"
+            " bw %gkbit/s\n",
+            opt.pairs, (unsigned long) opt.size, opt.both ? " both ways" : "",
+            opt.window, opt.timeout, opt.spread,
+            opt.loss * 100, opt.dup * 100, opt.reorder * 100,
+            opt.delay / 1000.0, opt.jitter / 1000.0, opt.bw * 8 / 1000.0);
+    printf ("completed %ld/%ld, corrupt %ld, truncated %ld, still open %ld,"
+            " %.3f s simulated, %.3f s cpu, %lu events\n",
+            completed, opt.pairs, corrupt, truncated, live, stub_clock / 1e6,
+            (double) cpu / CLOCKS_PER_SEC, (unsigned long) nevents);
+    hist_print (stdout, "", "completion", &completion);
+    rel_dump_stats (NULL, stdout);
+    return completed == opt.pairs && !corrupt ? 0 : 1;
+}
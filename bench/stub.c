@@ -0,0 +1,133 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "stub.h"
+
+uint64_t stub_clock;
+
+uint64_t
+now_usec (void)
+{
+    return stub_clock;
+}
+
+conn_t *
+stub_conn (void)
+{
+    conn_t *c = xmalloc (sizeof (*c));
+    memset (c, 0, sizeof (*c));
+    return c;
+}
+
+void
+stub_conn_free (conn_t *c)
+{
+    free (c);
+}
+
+conn_t *
+conn_create (rel_t *rel, const struct sockaddr_storage *ss)
+{
+    conn_t *c = stub_conn ();
+    c->rel = rel;
+    return c;
+}
+
+int
+conn_sendpkt (conn_t *c, const packet_t *pkt, size_t len)
+{
+    c->pkts_sent++;
+    if (c->send)
+        c->send (c, pkt, len);
+    return len;
+}
+
+int
+conn_lastpath (conn_t *c)
+{
+    return 0;
+}
+
+void
+conn_path_feedback (conn_t *c, int path, uint64_t rtt, int lost)
+{
+}
+
+const char *
+conn_input_map (conn_t *c, size_t *len)
+{
+    return NULL;
+}
+
+int
+conn_output_at (conn_t *c, const void *buf, size_t len, uint64_t off)
+{
+    return -1;
+}
+
+uint64_t
+conn_rxtime (conn_t *c)
+{
+    return now_usec ();
+}
+
+size_t
+conn_bufspace (conn_t *c)
+{
+    return c->bufspace ? c->bufspace (c) : 8192;
+}
+
+int
+conn_output (conn_t *c, const void *buf, size_t len)
+{
+    int n = len;
+
+    if (len == 0) {
+        c->write_eof = 1;
+        return 0;
+    }
+    if (c->output)
+        n = c->output (c, buf, len);
+    if (n > 0)
+        c->bytes_out += n;
+    return n;
+}
+
+int
+conn_input (conn_t *c, void *buf, size_t len)
+{
+    return c->input ? c->input (c, buf, len) : 0;
+}
+
+void
+conn_destroy (conn_t *c)
+{
+    c->destroyed = 1;
+    if (c->destroy)
+        c->destroy (c);
+}
+
+/* A single stream, so the conn_stream_ functions only see stream 0 */
+int
+conn_nstreams (conn_t *c)
+{
+    return 1;
+}
+
+size_t
+conn_stream_bufspace (conn_t *c, int s)
+{
+    return conn_bufspace (c);
+}
+
+int
+conn_stream_output (conn_t *c, int s, const void *buf, size_t len)
+{
+    return conn_output (c, buf, len);
+}
+
+int
+conn_stream_input (conn_t *c, int s, void *buf, size_t len)
+{
+    return conn_input (c, buf, len);
+}
@@ -0,0 +1,38 @@
+/* In-memory connection layer for benchmarks and simulations.
+
+   Replaces the socket half of rlib.c (build rlib.c with
+   -DRLIB_UTIL_ONLY=1) so that reliable.c can be driven without
+   sockets, poll() or the real clock.  Every hook has a default:
+   packets are dropped, input is empty, output is accepted in full.  */
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include "../rlib.h"
+
+struct conn {
+    rel_t *rel;
+    void *arg;			/* for the driver */
+
+    /* Hooks, called in place of the socket and stdio operations */
+    void (*send) (conn_t *, const packet_t *, size_t);
+    int (*input) (conn_t *, void *, size_t);
+    int (*output) (conn_t *, const void *, size_t);
+    size_t (*bufspace) (conn_t *);
+    void (*destroy) (conn_t *);	/* rel_destroy called conn_destroy */
+
+    char destroyed;		/* rel_destroy was called */
+    char write_eof;		/* conn_output got len 0 */
+
+    uint64_t pkts_sent;
+    uint64_t bytes_out;
+};
+
+/* The value now_usec() returns; drivers advance it themselves. */
+extern uint64_t stub_clock;
+
+/* Creates a connection with default hooks, for rel_create (c, ...). */
+conn_t *stub_conn (void);
+
+/* Frees a connection after rel_destroy. */
+void stub_conn_free (conn_t *c);
@@ -0,0 +1,249 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "logq.h"
+
+struct logq {
+    char *name;
+    int fd;
+    char *buf;
+    size_t size;			/* power of 2 */
+    uint64_t rotate;
+    int policy;
+
+    /* The event loop's side */
+    uint64_t head __attribute__ ((aligned (64)));	/* bytes put in, ever */
+    uint64_t accepted, dropped, drops, waits;
+    size_t peak;
+    int waiting;			/* LOGQ_BLOCK: waiting for room */
+    char started, failed;
+
+    /* The thread's side */
+    uint64_t tail __attribute__ ((aligned (64)));	/* bytes taken out, ever */
+    uint64_t file_bytes;		/* in the current file */
+    uint64_t written, writes, errors;
+    unsigned rotations;
+    int sleeping;			/* waiting for more */
+    int stop;
+
+    pthread_t thread __attribute__ ((aligned (64)));
+    pthread_mutex_t lock;		/* only to sleep and wake up */
+    pthread_cond_t more, room;
+};
+
+struct logq *
+logq_open (const char *name, size_t bufsize, uint64_t rotate, int policy)
+{
+    struct logq *q;
+    size_t size = 4096;
+
+    while (size < bufsize)
+        size <<= 1;
+    if (!(q = calloc (1, sizeof (*q)))
+            || !(q->buf = malloc (size))
+            || !(q->name = strdup (name))) {
+        perror ("logq");
+        exit (1);
+    }
+    if ((q->fd = open (name, O_CREAT|O_TRUNC|O_WRONLY, 0666)) < 0) {
+        perror (name);
+        free (q->name);
+        free (q->buf);
+        free (q);
+        return NULL;
+    }
+    q->size = size;
+    q->rotate = rotate;
+    q->policy = policy;
+    pthread_mutex_init (&q->lock, NULL);
+    pthread_cond_init (&q->more, NULL);
+    pthread_cond_init (&q->room, NULL);
+    return q;
+}
+
+static void
+logq_rotate (struct logq *q)
+{
+    char *old = malloc (strlen (q->name) + 16);
+
+    close (q->fd);
+    sprintf (old, "%s.%u", q->name,
+             __atomic_add_fetch (&q->rotations, 1, __ATOMIC_RELAXED));
+    if (rename (q->name, old) < 0)
+        perror (old);
+    free (old);
+    if ((q->fd = open (q->name, O_CREAT|O_TRUNC|O_WRONLY, 0666)) < 0)
+        perror (q->name);
+    q->file_bytes = 0;
+}
+
+static void *
+logq_thread (void *arg)
+{
+    struct logq *q = arg;
+
+    for (;;) {
+        uint64_t head = __atomic_load_n (&q->head, __ATOMIC_ACQUIRE);
+        size_t off, len;
+        ssize_t n;
+
+        if (head == q->tail) {
+            if (__atomic_load_n (&q->stop, __ATOMIC_ACQUIRE))
+                break;
+            pthread_mutex_lock (&q->lock);
+            __atomic_store_n (&q->sleeping, 1, __ATOMIC_SEQ_CST);
+            if (__atomic_load_n (&q->head, __ATOMIC_SEQ_CST) == q->tail
+                    && !__atomic_load_n (&q->stop, __ATOMIC_ACQUIRE))
+                pthread_cond_wait (&q->more, &q->lock);
+            __atomic_store_n (&q->sleeping, 0, __ATOMIC_RELAXED);
+            pthread_mutex_unlock (&q->lock);
+            continue;
+        }
+
+        /* As much as is in one piece, not past a rotation */
+        off = q->tail & (q->size - 1);
+        len = head - q->tail;
+        if (len > q->size - off)
+            len = q->size - off;
+        if (q->rotate && len > q->rotate - q->file_bytes)
+            len = q->rotate - q->file_bytes;
+        n = q->fd < 0 ? -1 : write (q->fd, q->buf + off, len);
+        if (n < 0) {
+            if (q->fd >= 0 && errno == EINTR)
+                continue;
+            /* Lose it rather than stop the loop that is feeding us */
+            __atomic_add_fetch (&q->errors, 1, __ATOMIC_RELAXED);
+            n = len;
+        }
+        else {
+            __atomic_add_fetch (&q->written, n, __ATOMIC_RELAXED);
+            __atomic_add_fetch (&q->writes, 1, __ATOMIC_RELAXED);
+            q->file_bytes += n;
+        }
+        __atomic_store_n (&q->tail, q->tail + n, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n (&q->waiting, __ATOMIC_SEQ_CST)) {
+            pthread_mutex_lock (&q->lock);
+            pthread_cond_signal (&q->room);
+            pthread_mutex_unlock (&q->lock);
+        }
+        if (q->rotate && q->file_bytes >= q->rotate)
+            logq_rotate (q);
+    }
+    return NULL;
+}
+
+static void
+logq_start (struct logq *q)
+{
+    sigset_t all, old;
+
+    /* Leave the signals to the event loop */
+    sigfillset (&all);
+    pthread_sigmask (SIG_SETMASK, &all, &old);
+    if (pthread_create (&q->thread, NULL, logq_thread, q) != 0) {
+        fprintf (stderr, "%s: cannot start log thread, writing directly\n",
+                 q->name);
+        q->failed = 1;
+    }
+    pthread_sigmask (SIG_SETMASK, &old, NULL);
+    q->started = 1;
+}
+
+void
+logq_write (struct logq *q, const void *_buf, size_t n)
+{
+    const char *buf = _buf;
+
+    if (!q->started)
+        logq_start (q);
+    if (q->failed) {
+        if (q->fd >= 0 && write (q->fd, buf, n) < 0)
+            q->errors++;
+        return;
+    }
+
+    while (n > 0) {
+        uint64_t tail = __atomic_load_n (&q->tail, __ATOMIC_ACQUIRE);
+        size_t space = q->size - (q->head - tail);
+        size_t off = q->head & (q->size - 1);
+        size_t k;
+
+        if (n > space && q->policy == LOGQ_DROP) {
+            q->dropped += n;
+            q->drops++;
+            return;
+        }
+        if (!space) {
+            q->waits++;
+            pthread_mutex_lock (&q->lock);
+            __atomic_store_n (&q->waiting, 1, __ATOMIC_SEQ_CST);
+            while (__atomic_load_n (&q->tail, __ATOMIC_SEQ_CST) == tail)
+                pthread_cond_wait (&q->room, &q->lock);
+            __atomic_store_n (&q->waiting, 0, __ATOMIC_RELAXED);
+            pthread_mutex_unlock (&q->lock);
+            continue;
+        }
+
+        k = n < space ? n : space;
+        if (k > q->size - off) {
+            memcpy (q->buf + off, buf, q->size - off);
+            memcpy (q->buf, buf + (q->size - off), k - (q->size - off));
+        }
+        else
+            memcpy (q->buf + off, buf, k);
+        __atomic_store_n (&q->head, q->head + k, __ATOMIC_SEQ_CST);
+        if (q->head - tail > q->peak)
+            q->peak = q->head - tail;
+        q->accepted += k;
+        buf += k;
+        n -= k;
+
+        /* Pairs with the thread's check before it sleeps */
+        if (__atomic_load_n (&q->sleeping, __ATOMIC_SEQ_CST)) {
+            pthread_mutex_lock (&q->lock);
+            pthread_cond_signal (&q->more);
+            pthread_mutex_unlock (&q->lock);
+        }
+    }
+}
+
+void
+logq_close (struct logq *q)
+{
+    if (q->started && !q->failed) {
+        pthread_mutex_lock (&q->lock);
+        __atomic_store_n (&q->stop, 1, __ATOMIC_RELEASE);
+        pthread_cond_signal (&q->more);
+        pthread_mutex_unlock (&q->lock);
+        pthread_join (q->thread, NULL);
+    }
+    if (q->fd >= 0)
+        close (q->fd);
+    pthread_mutex_destroy (&q->lock);
+    pthread_cond_destroy (&q->more);
+    pthread_cond_destroy (&q->room);
+    free (q->name);
+    free (q->buf);
+    free (q);
+}
+
+void
+logq_dump (struct logq *q, FILE *f, const char *label)
+{
+    fprintf (f, "  %-14s queued=%lu written=%lu writes=%lu dropped=%lu/%lu"
+             " waits=%lu peak=%lu/%lu rotations=%u errors=%lu\n", label,
+             (unsigned long) q->accepted,
+             (unsigned long) __atomic_load_n (&q->written, __ATOMIC_RELAXED),
+             (unsigned long) __atomic_load_n (&q->writes, __ATOMIC_RELAXED),
+             (unsigned long) q->dropped, (unsigned long) q->drops,
+             (unsigned long) q->waits, (unsigned long) q->peak,
+             (unsigned long) q->size,
+             __atomic_load_n (&q->rotations, __ATOMIC_RELAXED),
+             (unsigned long) __atomic_load_n (&q->errors, __ATOMIC_RELAXED));
+}
@@ -0,0 +1,44 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* -----------------------------------------------------------------------
+
+   Asynchronous capture file for the -l input and output logs.
+
+   logq_write copies into a byte ring and returns; a thread of its own
+   drains the ring to the file in large writes.  The ring is lock-free
+   for one writer, the event loop, and the thread: each side moves only
+   its own index.  The thread is only woken when it went to sleep on
+   an empty ring.
+
+   The ring is the memory budget.  When a write does not fit, it is
+   either dropped and counted (LOGQ_DROP), or the caller waits for the
+   thread to make room (LOGQ_BLOCK).  With a rotate size, the file is
+   renamed to name.1, name.2, ... each time it grows past it, and a new
+   one is started.
+
+   The thread is started by the first logq_write.  A logq belongs to
+   one process: the server's workers each open their own once forked,
+   with the worker's pid in the file name.
+
+ */
+
+#define LOGQ_DROP  0
+#define LOGQ_BLOCK 1
+
+struct logq;
+
+/* Create (truncate) the file name.  bufsize is rounded up to a power
+   of 2.  rotate is 0 for one file that grows without limit.  Returns
+   NULL and prints the reason if the file cannot be opened. */
+struct logq *logq_open (const char *name, size_t bufsize, uint64_t rotate,
+                        int policy);
+
+void logq_write (struct logq *q, const void *buf, size_t n);
+
+/* Write out what is queued, stop the thread and close the file. */
+void logq_close (struct logq *q);
+
+/* One line of counters, as in the SIGUSR1 dump. */
+void logq_dump (struct logq *q, FILE *f, const char *label);
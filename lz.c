@@ -0,0 +1,154 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+#define LZ_HASH_BITS 12
+
+static inline uint32_t
+read32 (const uint8_t *p)
+{
+    uint32_t v;
+    memcpy (&v, p, 4);
+    return v;
+}
+
+static inline unsigned int
+hash4 (uint32_t v)
+{
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/* Extra bytes needed to encode a nibble field of value n */
+static inline size_t
+ext_bytes (size_t n)
+{
+    return n < 15 ? 0 : (n - 15) / 255 + 1;
+}
+
+static uint8_t *
+put_ext (uint8_t *op, size_t n)
+{
+    if (n < 15)
+        return op;
+    for (n -= 15; n >= 255; n -= 255)
+        *op++ = 255;
+    *op++ = n;
+    return op;
+}
+
+size_t
+lz_compress (const void *_src, size_t srclen,
+             void *_dst, size_t dstcap, size_t *used)
+{
+    const uint8_t *src = _src;
+    const uint8_t *ip = src, *anchor = src, *end;
+    uint8_t *op = _dst, *oend = op + dstcap;
+    uint16_t table[1 << LZ_HASH_BITS];	/* position + 1, 0 for none */
+    size_t lits, room;
+
+    if (srclen > LZ_MAX_BLOCK - 1)
+        srclen = LZ_MAX_BLOCK - 1;
+    end = src + srclen;
+    memset (table, 0, sizeof (table));
+
+    while (end - ip >= LZ_MIN_MATCH) {
+        uint32_t v = read32 (ip);
+        unsigned int h = hash4 (v);
+        const uint8_t *ref = table[h] ? src + table[h] - 1 : NULL;
+        size_t mlen, need;
+
+        table[h] = ip - src + 1;
+        if (!ref || read32 (ref) != v) {
+            ip++;
+            continue;
+        }
+        for (mlen = LZ_MIN_MATCH; ip + mlen < end && ip[mlen] == ref[mlen]; mlen++)
+            ;
+        lits = ip - anchor;
+        need = 1 + ext_bytes (lits) + lits + 2 + ext_bytes (mlen - LZ_MIN_MATCH);
+        if (need > (size_t) (oend - op))
+            break;
+
+        *op++ = (lits < 15 ? lits : 15) << 4
+            | (mlen - LZ_MIN_MATCH < 15 ? mlen - LZ_MIN_MATCH : 15);
+        op = put_ext (op, lits);
+        memcpy (op, anchor, lits);
+        op += lits;
+        *op++ = (ip - ref) & 0xff;
+        *op++ = (ip - ref) >> 8;
+        op = put_ext (op, mlen - LZ_MIN_MATCH);
+        ip += mlen;
+        anchor = ip;
+    }
+
+    /* Whatever is left goes out as literals, as far as it fits */
+    lits = end - anchor;
+    room = oend - op;
+    while (lits && 1 + ext_bytes (lits) + lits > room)
+        lits--;
+    if (lits) {
+        *op++ = (lits < 15 ? lits : 15) << 4;
+        op = put_ext (op, lits);
+        memcpy (op, anchor, lits);
+        op += lits;
+    }
+    *used = anchor + lits - src;
+    return op - (uint8_t *) _dst;
+}
+
+/* Reads a nibble extension; returns -1 past the end of the block */
+static inline int
+get_ext (const uint8_t **ipp, const uint8_t *iend, size_t *n)
+{
+    const uint8_t *ip = *ipp;
+    uint8_t b;
+
+    if (*n != 15)
+        return 0;
+    do {
+        if (ip >= iend)
+            return -1;
+        b = *ip++;
+        *n += b;
+    } while (b == 255);
+    *ipp = ip;
+    return 0;
+}
+
+int
+lz_decompress (const void *src, size_t srclen, void *_dst, size_t dstcap)
+{
+    const uint8_t *ip = src, *iend = ip + srclen;
+    uint8_t *dst = _dst, *op = dst, *oend = dst + dstcap;
+
+    while (ip < iend) {
+        unsigned int token = *ip++;
+        size_t n = token >> 4;
+        size_t off;
+
+        if (get_ext (&ip, iend, &n) < 0
+                || n > (size_t) (iend - ip) || n > (size_t) (oend - op))
+            return -1;
+        memcpy (op, ip, n);
+        op += n;
+        ip += n;
+        if (ip == iend)
+            break;
+
+        if (iend - ip < 2)
+            return -1;
+        off = ip[0] | ip[1] << 8;
+        ip += 2;
+        n = token & 15;
+        if (get_ext (&ip, iend, &n) < 0)
+            return -1;
+        n += LZ_MIN_MATCH;
+        if (off == 0 || off > (size_t) (op - dst) || n > (size_t) (oend - op))
+            return -1;
+        /* Byte by byte, the match may overlap what it produces */
+        for (const uint8_t *m = op - off; n; n--)
+            *op++ = *m++;
+    }
+    return op - dst;
+}
@@ -0,0 +1,31 @@
+#include <stddef.h>
+
+/* -----------------------------------------------------------------------
+
+   Small LZ77 block codec for payload compression (-z).
+
+   A block is a series of sequences.  Each starts with a token byte,
+   literal count in the high nibble and match length - LZ_MIN_MATCH in
+   the low one, a nibble of 15 being continued by bytes that are added
+   on until one is below 255.  The literals follow, then a 2-byte
+   little-endian offset back into the output and the match length
+   extension.  The last sequence may end after its literals.  This is
+   the LZ4 block layout without its end-of-block restrictions.
+
+   Blocks are independent of each other, so every packet decodes on
+   its own, whatever was lost or retransmitted before it.
+
+ */
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_BLOCK 65535	/* Match offsets are 16 bits */
+
+/* Compress from src into at most dstcap bytes of dst, stopping early
+   when dst is full.  *used is set to the number of bytes of src that
+   went in; returns the size of the compressed block. */
+size_t lz_compress (const void *src, size_t srclen,
+                    void *dst, size_t dstcap, size_t *used);
+
+/* Returns the decompressed size, or -1 if src is not a valid block or
+   would decompress to more than dstcap bytes. */
+int lz_decompress (const void *src, size_t srclen, void *dst, size_t dstcap);
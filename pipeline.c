@@ -0,0 +1,386 @@
+#ifdef __linux__
+# define _GNU_SOURCE
+#endif /* __linux__ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#ifdef __linux__
+# include <sched.h>
+# include <sys/eventfd.h>
+#endif /* __linux__ */
+
+#include "ring.h"
+#include "pipeline.h"
+
+#define BLOCK 65536			/* bytes per read and per write */
+#define NBLOCKS 16			/* per ring */
+
+struct pipeline {
+    int rfd, wfd;
+    int cpu;
+    struct ring *in, *out;
+    int in_more, out_room;	/* eventfds the loop polls */
+    int in_room, out_more;	/* eventfds the threads block on */
+
+    /* The event loop's side */
+    const char *in_block;		/* block being read from, or NULL */
+    size_t in_len, in_off;
+    char in_eof;
+    char out_eof;			/* EOF still to pass on */
+    char *out_block;		/* slot being filled, or NULL */
+    size_t out_cap, out_len;
+    uint64_t in_waits, out_waits;	/* no input / no room for output */
+
+    /* Set by one side for the other */
+    int reader_waiting __attribute__ ((aligned (64)));	/* for room */
+    int loop_waiting;		/* for room for output */
+    int read_errno;		/* comes with the EOF block */
+    int writer_done;		/* 1 after EOF, 2 after an error */
+
+    /* The threads' counters */
+    uint64_t blocks_in __attribute__ ((aligned (64))), bytes_in, reader_waits;
+    uint64_t blocks_out __attribute__ ((aligned (64))), bytes_out, writer_waits;
+    pthread_t reader, writer;
+};
+
+static void
+efd_signal (int fd)
+{
+    uint64_t one = 1;
+    if (write (fd, &one, sizeof (one)) < 0 && errno != EAGAIN)
+        perror ("eventfd");
+}
+
+/* Blocks on the threads' eventfds, only clears the loop's */
+static void
+efd_clear (int fd)
+{
+    uint64_t n;
+    while (read (fd, &n, sizeof (n)) < 0 && errno == EINTR)
+        ;
+}
+
+static void
+pin (int cpu)
+{
+#ifdef __linux__
+    cpu_set_t set;
+
+    if (cpu < 0)
+        return;
+    CPU_ZERO (&set);
+    CPU_SET (cpu, &set);
+    if ((errno = pthread_setaffinity_np (pthread_self (), sizeof (set), &set)))
+        perror ("pthread_setaffinity_np");
+#endif /* __linux__ */
+}
+
+static void *
+reader_thread (void *arg)
+{
+    struct pipeline *p = arg;
+
+    pin (p->cpu);
+    for (;;) {
+        size_t cap;
+        char *block;
+        ssize_t n;
+
+        if (!(block = ring_reserve (p->in, &cap))) {
+            /* Pairs with the loop's check after it takes a block */
+            __atomic_store_n (&p->reader_waiting, 1, __ATOMIC_SEQ_CST);
+            __atomic_thread_fence (__ATOMIC_SEQ_CST);
+            if (!ring_free (p->in)) {
+                __atomic_add_fetch (&p->reader_waits, 1, __ATOMIC_RELAXED);
+                efd_clear (p->in_room);
+            }
+            __atomic_store_n (&p->reader_waiting, 0, __ATOMIC_RELAXED);
+            continue;
+        }
+        n = read (p->rfd, block, cap);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            p->read_errno = errno;
+            n = 0;
+        }
+        else if (n > 0) {
+            __atomic_add_fetch (&p->blocks_in, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch (&p->bytes_in, n, __ATOMIC_RELAXED);
+        }
+        /* An empty block is the EOF */
+        if (ring_commit (p->in, n))
+            efd_signal (p->in_more);
+        if (n == 0)
+            return NULL;
+    }
+}
+
+static void *
+writer_thread (void *arg)
+{
+    struct pipeline *p = arg;
+    const char *block;
+    size_t len, off;
+    ssize_t n;
+
+    pin (p->cpu >= 0 ? p->cpu + 1 : -1);
+    for (;;) {
+        if (!(block = ring_peek (p->out, &len))) {
+            __atomic_add_fetch (&p->writer_waits, 1, __ATOMIC_RELAXED);
+            efd_clear (p->out_more);
+            continue;
+        }
+        if (!len)
+            break;
+        for (off = 0; off < len; off += n)
+            if ((n = write (p->wfd, block + off, len - off)) < 0) {
+                if (errno == EINTR) {
+                    n = 0;
+                    continue;
+                }
+                perror ("write");
+                __atomic_store_n (&p->writer_done, 2, __ATOMIC_RELEASE);
+                efd_signal (p->out_room);
+                return NULL;
+            }
+        __atomic_add_fetch (&p->blocks_out, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch (&p->bytes_out, len, __ATOMIC_RELAXED);
+        ring_release (p->out);
+
+        /* Pairs with the loop's check after it found no room */
+        __atomic_thread_fence (__ATOMIC_SEQ_CST);
+        if (__atomic_load_n (&p->loop_waiting, __ATOMIC_RELAXED))
+            efd_signal (p->out_room);
+    }
+    shutdown (p->wfd, SHUT_WR);
+    __atomic_store_n (&p->writer_done, 1, __ATOMIC_RELEASE);
+    efd_signal (p->out_room);
+    return NULL;
+}
+
+struct pipeline *
+pipeline_start (int rfd, int wfd, int cpu)
+{
+#ifdef __linux__
+    struct pipeline *p = calloc (1, sizeof (*p));
+    size_t size = ring_size (NBLOCKS, BLOCK);
+    void *in = calloc (1, size), *out = calloc (1, size);
+    sigset_t all, old;
+    int err;
+
+    if (p)
+        p->in_more = p->out_room = p->in_room = p->out_more = -1;
+    if (!p || !in || !out) {
+        errno = ENOMEM;
+        goto fail;
+    }
+    p->rfd = rfd;
+    p->wfd = wfd;
+    p->cpu = cpu;
+    p->in = ring_init (in, NBLOCKS, BLOCK);
+    p->out = ring_init (out, NBLOCKS, BLOCK);
+    if ((p->in_more = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0
+            || (p->out_room = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0
+            || (p->in_room = eventfd (0, EFD_CLOEXEC)) < 0
+            || (p->out_more = eventfd (0, EFD_CLOEXEC)) < 0)
+        goto fail;
+
+    /* The threads may block, the loop never waits on them */
+    fcntl (rfd, F_SETFL, fcntl (rfd, F_GETFL) & ~O_NONBLOCK);
+    fcntl (wfd, F_SETFL, fcntl (wfd, F_GETFL) & ~O_NONBLOCK);
+
+    /* Leave the signals to the event loop */
+    sigfillset (&all);
+    pthread_sigmask (SIG_SETMASK, &all, &old);
+    if ((err = pthread_create (&p->reader, NULL, reader_thread, p)) == 0
+            && (err = pthread_create (&p->writer, NULL, writer_thread, p)) != 0) {
+        pthread_cancel (p->reader);
+        pthread_join (p->reader, NULL);
+    }
+    pthread_sigmask (SIG_SETMASK, &old, NULL);
+    if (err) {
+        errno = err;
+        goto fail;
+    }
+    return p;
+
+fail:
+    err = errno;
+    if (p) {
+        if (p->in_more >= 0)
+            close (p->in_more);
+        if (p->out_room >= 0)
+            close (p->out_room);
+        if (p->in_room >= 0)
+            close (p->in_room);
+        if (p->out_more >= 0)
+            close (p->out_more);
+    }
+    free (p);
+    free (in);
+    free (out);
+    errno = err;
+    return NULL;
+#else /* !__linux__ */
+    errno = ENOSYS;
+    return NULL;
+#endif /* !__linux__ */
+}
+
+int
+pipeline_input_fd (const struct pipeline *p)
+{
+    return p->in_more;
+}
+
+int
+pipeline_output_fd (const struct pipeline *p)
+{
+    return p->out_room;
+}
+
+int
+pipeline_read (struct pipeline *p, void *buf, size_t n)
+{
+    if (!p->in_block && !p->in_eof) {
+        if (!(p->in_block = ring_peek (p->in, &p->in_len))) {
+            /* Clear the wakeup before the last look, not after */
+            efd_clear (p->in_more);
+            if (!(p->in_block = ring_peek (p->in, &p->in_len))) {
+                p->in_waits++;
+                errno = EAGAIN;
+                return -1;
+            }
+        }
+        p->in_off = 0;
+        if (!p->in_len)
+            p->in_eof = 1;
+    }
+    if (p->in_eof) {
+        if (!p->read_errno)
+            return 0;
+        errno = p->read_errno;
+        return -1;
+    }
+
+    if (n > p->in_len - p->in_off)
+        n = p->in_len - p->in_off;
+    memcpy (buf, p->in_block + p->in_off, n);
+    if ((p->in_off += n) == p->in_len) {
+        ring_release (p->in);
+        p->in_block = NULL;
+        __atomic_thread_fence (__ATOMIC_SEQ_CST);
+        if (__atomic_load_n (&p->reader_waiting, __ATOMIC_RELAXED))
+            efd_signal (p->in_room);
+    }
+    return n;
+}
+
+/* The slot output goes into, or NULL and a wakeup when there is one */
+static char *
+out_slot (struct pipeline *p)
+{
+    if (p->out_block)
+        return p->out_block;
+    if (!(p->out_block = ring_reserve (p->out, &p->out_cap))) {
+        __atomic_store_n (&p->loop_waiting, 1, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence (__ATOMIC_SEQ_CST);
+        if (!(p->out_block = ring_reserve (p->out, &p->out_cap))) {
+            p->out_waits++;
+            return NULL;
+        }
+        __atomic_store_n (&p->loop_waiting, 0, __ATOMIC_RELAXED);
+    }
+    return p->out_block;
+}
+
+static void
+out_commit (struct pipeline *p)
+{
+    if (ring_commit (p->out, p->out_len))
+        efd_signal (p->out_more);
+    p->out_block = NULL;
+    p->out_len = 0;
+}
+
+size_t
+pipeline_space (struct pipeline *p)
+{
+    size_t space = (size_t) ring_free (p->out) * BLOCK - p->out_len;
+
+    /* Less than a block may be too little for the caller, who then
+     * needs to hear when the writer frees one */
+    if (space < BLOCK) {
+        __atomic_store_n (&p->loop_waiting, 1, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence (__ATOMIC_SEQ_CST);
+        space = (size_t) ring_free (p->out) * BLOCK - p->out_len;
+    }
+    return space;
+}
+
+size_t
+pipeline_write (struct pipeline *p, const void *_buf, size_t n)
+{
+    const char *buf = _buf;
+    size_t done = 0, k;
+
+    while (done < n && out_slot (p)) {
+        k = n - done < p->out_cap - p->out_len ? n - done : p->out_cap - p->out_len;
+        memcpy (p->out_block + p->out_len, buf + done, k);
+        p->out_len += k;
+        done += k;
+        if (p->out_len == p->out_cap)
+            out_commit (p);
+    }
+    return done;
+}
+
+void
+pipeline_flush (struct pipeline *p)
+{
+    if (p->out_len)
+        out_commit (p);
+    if (p->out_eof && out_slot (p)) {
+        out_commit (p);
+        p->out_eof = 0;
+    }
+}
+
+void
+pipeline_close_output (struct pipeline *p)
+{
+    p->out_eof = 1;
+    pipeline_flush (p);
+}
+
+int
+pipeline_wakeup (struct pipeline *p)
+{
+    efd_clear (p->out_room);
+    __atomic_store_n (&p->loop_waiting, 0, __ATOMIC_RELAXED);
+    pipeline_flush (p);
+    return __atomic_load_n (&p->writer_done, __ATOMIC_ACQUIRE);
+}
+
+void
+pipeline_dump (struct pipeline *p, FILE *f)
+{
+    fprintf (f, "  %-14s in=%lu/%lu reader_waits=%lu in_waits=%lu"
+             " out=%lu/%lu writer_waits=%lu out_waits=%lu (bytes/blocks)\n",
+             "pipeline",
+             (unsigned long) __atomic_load_n (&p->bytes_in, __ATOMIC_RELAXED),
+             (unsigned long) __atomic_load_n (&p->blocks_in, __ATOMIC_RELAXED),
+             (unsigned long) __atomic_load_n (&p->reader_waits, __ATOMIC_RELAXED),
+             (unsigned long) p->in_waits,
+             (unsigned long) __atomic_load_n (&p->bytes_out, __ATOMIC_RELAXED),
+             (unsigned long) __atomic_load_n (&p->blocks_out, __ATOMIC_RELAXED),
+             (unsigned long) __atomic_load_n (&p->writer_waits, __ATOMIC_RELAXED),
+             (unsigned long) p->out_waits);
+}
@@ -0,0 +1,60 @@
+#include <stdio.h>
+#include <stddef.h>
+
+/* -----------------------------------------------------------------------
+
+   Pipelined input and output of a connection (-p).
+
+   A reader thread reads the input in blocks straight into the slots
+   of a ring (ring.c), and a writer thread writes the output from the
+   slots of another, so the event loop is left with the protocol and
+   the network.  Each ring has one producer and one consumer and no
+   locks.  The event loop takes input from the block at the head of
+   its ring and puts output into the slot at the tail of the other,
+   in place.
+
+   Between the threads and the event loop go eventfd wakeups, and
+   only when one side has to wait: the loop polls pipeline_input_fd
+   after pipeline_read found no input, and pipeline_output_fd after
+   pipeline_write found no room; the threads block on theirs.  Output
+   goes to the writer a block at a time, or by pipeline_flush, which
+   the loop calls once per round.
+
+ */
+
+struct pipeline;
+
+/* Start the threads on rfd and wfd, which are switched to blocking.
+   With cpu >= 0, the reader is pinned to cpu and the writer to cpu+1.
+   Returns NULL (with errno) if they cannot be started. */
+struct pipeline *pipeline_start (int rfd, int wfd, int cpu);
+
+/* The eventfds the loop polls for input and for output room.  Reading
+   them is left to pipeline_read and pipeline_wakeup. */
+int pipeline_input_fd (const struct pipeline *p);
+int pipeline_output_fd (const struct pipeline *p);
+
+/* As read (2) on the input: up to n bytes, 0 at EOF, or -1 with errno
+   EAGAIN when no block is in yet, or the reader's error. */
+int pipeline_read (struct pipeline *p, void *buf, size_t n);
+
+/* Bytes pipeline_write takes at least. */
+size_t pipeline_space (struct pipeline *p);
+
+/* Take as much of buf as there is room for; returns how much. */
+size_t pipeline_write (struct pipeline *p, const void *buf, size_t n);
+
+/* Pass a partly filled output block, and a pending EOF, on to the
+   writer. */
+void pipeline_flush (struct pipeline *p);
+
+/* EOF on the output, after everything written before it. */
+void pipeline_close_output (struct pipeline *p);
+
+/* Clear a wakeup on pipeline_output_fd and pass on what waited for
+   room.  Returns nonzero once the writer has written everything up to
+   EOF, or given up on an error. */
+int pipeline_wakeup (struct pipeline *p);
+
+/* A line of counters for the SIGUSR1 dump. */
+void pipeline_dump (struct pipeline *p, FILE *f);
@@ -13,6 +13,8 @@
 #include <netinet/in.h>
 
 #include "rlib.h"
+#include "stats.h"
+#include "lz.h"
 
 
 #define EOF_RECV(flag)                      (flag & 0x01)
@@ -32,15 +34,104 @@
 #define UNSET_LAST_ALLOCATED_ALREADY_SENT(flag) (flag = flag & ~0x10)
 #define UNSET_SMALL_PACKET_ONLINE(flag)         (flag = flag & ~0x20)
 
+// Hello: it goes out after the first this many packets we send
+#define HELLOS 8
+
+// Compression: after a packet that did not shrink, send this many raw
+// before trying again
+#define LZ_SKIP 16
+
 void send_packet(rel_t*, uint32_t);
+void send_unsent(rel_t*);
+void send_ack(rel_t*);
+void stream_read(rel_t*);
+void lz_read(rel_t*);
+void map_read(rel_t*);
+int place_recv(rel_t*, const char*, uint16_t, uint32_t, uint64_t);
+size_t free_seqno(rel_t*);
+size_t send_window(rel_t*);
+size_t slot_space(rel_t*);
+void hello_send(rel_t*);
+int hello_recv(rel_t*, const struct hello*);
+size_t recv_window(rel_t*);
+int stream_recv(rel_t*, packet_t*, uint32_t, uint16_t);
+int stream_output(rel_t*);
+void fec_flush(rel_t*);
+void fec_recv(rel_t*, struct parity_packet*, uint16_t);
+void rel_tick(rel_t*);
+uint16_t pkt_cksum(rel_t*, const void*, int);
+void rto_update(rel_t*, uint64_t);
 void save_pkt_to_file(packet_t *pkt);
 
 typedef struct slice {
+    struct slice *next; /* pool: free list */
     char allocated;
-    char segment[500];
+    uint8_t tx_count;   /* how often this slice went out, saturating */
+    uint8_t path;       /* multipath: path of the last transmission */
+    uint8_t lz;         /* segment is an lz block */
+    uint8_t meta;       /* no segment: the data is at off, or in data */
     uint16_t len;
+    uint32_t refs;      /* fan-out: members that still need it */
+    uint64_t time;      /* send: last transmission, recv: arrival (usec) */
+    uint64_t off;
+    struct slice *data; /* fan-out: the shared slice with the data */
+    char segment[];     /* SEGMENT bytes, none in meta slices */
 } slice;
 
+#define SEGMENT 500
+#define SLICE_SIZE (sizeof(slice) + SEGMENT)
+
+void fec_add(rel_t*, uint32_t, const char*, uint16_t, uint16_t);
+void fec_keep(rel_t*, const packet_t*, uint16_t, uint16_t);
+
+// Fan-out: one input read once for several members, each a connection
+// to a receiver of its own.  Packet seqno carries the same data to
+// every member; it is in ring[seqno % size] until all of them have it
+// acked, and the members' send slots only point at it.
+typedef struct fanout {
+    rel_t *group;           // reads the input, sends nothing
+    rel_t **members;
+    int nmembers;
+    slice **ring;
+    size_t size;            // -G: how far the slowest may be behind
+    size_t base;            // oldest seqno still held
+    size_t head;            // next seqno to read
+    char drop;              // cut the slowest off rather than wait
+    char eof;               // head - 1 carries the EOF
+    char starved;           // a member found the ring full
+} fanout;
+
+void fan_read(rel_t*);
+void fan_feed(fanout*);
+void fan_release(fanout*, size_t, size_t);
+void fan_leave(rel_t*);
+void fan_free(fanout*);
+
+// Multi-stream: packets of one stream the receiver buffers ahead of
+// delivery, which is also the credit it hands out per stream
+#define STREAM_QUEUE 32
+
+typedef struct stream_state {
+    // sending
+    uint32_t next_sseq;     // sseq of the next packet
+    uint32_t credit;        // peer takes sseq below this
+    char eof_read;
+
+    // receiving
+    uint32_t expect;        // next sseq for conn_stream_output
+    size_t already_written;
+    char eof_written;
+    slice **queue;          // STREAM_QUEUE slots, by sseq
+} stream_state;
+
+// FEC: a data packet the receiver keeps for rebuilding its group
+typedef struct fec_entry {
+    uint32_t seqno;         // 0 for none
+    uint16_t len;
+    uint16_t flags;         // PKT_F_LZ
+    char data[500];
+} fec_entry;
+
 
 struct reliable_state {
     rel_t *next;        /* Linked list for traversing all connections */
@@ -48,29 +139,268 @@ struct reliable_state {
 
     conn_t *c;          /* This is the connection object */
 
-    slice* recv_buffer;
-    slice* send_buffer;
+    rel_t *hnext;       /* Server: chain in rel_hash */
+    struct sockaddr_storage peer;   /* Server: address of the client */
+
+    slice** recv_buffer;    /* window_size slots, filled from the pool */
+    slice** send_buffer;
 
-    size_t recv_seqno;
+    size_t recv_seqno;      /* ack point: everything below is buffered */
+    size_t deliver_seqno;   /* next for conn_output, <= recv_seqno */
     size_t send_seqno;
+    size_t rwnd;            /* window the peer advertised, from send_seqno */
     size_t window_size;
     size_t already_written;
     size_t eof_seqno;
+    uint64_t timeout;   /* retransmission timeout in usec */
+    uint64_t min_rto;   /* -t, the floor of timeout */
+    uint64_t granularity;   /* how often rel_tick runs, usec */
+    uint64_t srtt;      /* smoothed rtt in usec, 0 before the first sample */
+    uint64_t rttvar;
 
     char flags;
+    char stalled;       /* rel_read found the send window full */
+    char in_recvpkt;    /* rel_output leaves the ack to rel_recvpkt */
+    char pool_wait;     /* rel_read found the pool at its cap */
+    uint64_t active;    /* last data sent or received, usec */
+
+    int nstreams;       /* > 1 in multi-stream mode */
+    int next_stream;    /* stream_read: round robin */
+    stream_state *streams;
+    uint64_t credit_sent;   /* last ack with credits */
+
+    // Hello: what we announce and what the peer announced
+    size_t payload;         // largest payload, agreed
+    int ack_every;          // ack policy, agreed
+    int unacked;            // in-order packets not acked yet
+    int hellos;             // hellos we sent
+    char peer_hello;        // the peer's hello arrived
+    uint32_t peer_features;
+    size_t offset_from;     // file mode: first seqno sent with its offset
+
+    // FEC, sending: parity of the group being sent
+    int fec_group;          // data packets per parity, 0 for none
+    char fec_adaptive;      // fec_group follows fec_loss
+    double fec_loss;        // moving average of timeouts per packet
+    uint32_t fec_first;
+    uint16_t fec_count;
+    uint16_t fec_len_xor;
+    uint16_t fec_maxlen;
+    char *fec_xor;
+
+    // Compression: input waiting to be cut into packets
+    char lz;
+    char lz_eof;
+    char *lz_in;            // LZ_STAGE bytes
+    size_t lz_in_off;
+    size_t lz_in_len;
+    int lz_skip;
+
+    // File send mode: the input, mapped; seqno n carries the bytes
+    // from the off of its slot
+    const char *map;
+    size_t map_len;
+    size_t map_off;         // next byte to send
+
+    // Direct placement: data goes to the output file at its offset
+    char place;
+
+    char no_cksum;          // -K: checksums are left out
+    char send_full;         // a send found the socket full
+
+    // Fan-out: the group r is in, or leads
+    fanout *fan;
+    char cut;               // cut off for lagging, goes at the next tick
+
+    char lz_bad;            // a block did not decompress, goes at the next tick
+
+    // Server: a peer we cannot talk to stays in rel_hash, ignored,
+    // until it is quiet
+    char dead;
+
+    // FEC, receiving: recent data by seqno, from the first parity on
+    fec_entry *fec_ring;
+    size_t fec_ring_size;
     FILE *f;
 
+    struct rel_stats stats;
+    struct hist rtt;    /* send until cumulative ack, first transmissions only */
+    struct hist hold;   /* arrival in recv_buffer until conn_output took it */
+
 };
 rel_t *rel_list;
 
+// Server: connections by peer address, for rel_demux
+static rel_t **rel_hash;
+static size_t rel_hash_size;
+static size_t rel_hash_count;
+
+// Memory pool: window slots get a slice only while data is in flight
+// or waiting for conn_output, and give it back to a process-wide free
+// list afterwards.  The free list keeps POOL_RESERVE slices and
+// destroyed connections keep POOL_RELS rel_t's for reuse; the rest go
+// back to malloc.  With a cap (-M), a connection that wants more
+// backs off: the sender stops reading, the receiver drops and shrinks
+// its window.  Only the slot at the head of a window may go past the
+// cap, so every connection can still make progress.
+#define POOL_RESERVE 1024
+#define POOL_RELS    64
+
+// What a connection holds besides its windows goes after this long
+// without traffic
+#define IDLE_USEC 5000000
+
+static struct {
+    slice *slices;      // free list
+    size_t nfree;
+    rel_t *rels;        // destroyed connections, by next
+    size_t nrels;
+    size_t used;        // slices in slots
+    size_t peak;
+    size_t limit;       // cap on used, in bytes; 0 for none
+} pool;
+
+// An empty slot reads as this; never write to it
+static slice no_slice;
+#define SLOT(s) ((s) ? (s) : &no_slice)
+
+// Multi-stream: marks a recv_buffer slot as received, the data is in
+// the stream queue
+static slice slot_received = { .allocated = 1 };
+
+// The slice in *slot, taken from the pool if it has none.  Returns
+// NULL at the cap unless force is set.
+slice *slot_take(slice **slot, int force)
+{
+    slice *s = *slot;
+
+    if (s) return s;
+    if (pool.limit && !force && (pool.used + 1) * SLICE_SIZE > pool.limit) {
+        return NULL;
+    }
+    s = pool.slices;
+    if (s) {
+        pool.slices = s->next;
+        pool.nfree--;
+    }
+    else {
+        s = malloc(SLICE_SIZE);
+        assert(s != NULL && "Malloc failed!");
+    }
+    s->allocated = 0;
+    s->tx_count  = 0;
+    s->path      = 0;
+    s->lz        = 0;
+    s->meta      = 0;
+    s->time      = 0;
+    s->len       = 0;
+    s->refs      = 0;
+    s->data      = NULL;
+    if (++pool.used > pool.peak) pool.peak = pool.used;
+    *slot = s;
+    return s;
+}
+
+// File send mode: a slice without a segment for *slot.  It is small
+// and outside the pool and its cap.
+slice *slot_take_meta(slice **slot)
+{
+    slice *s = *slot;
+
+    if (s) return s;
+    s = calloc(1, sizeof(slice));
+    assert(s != NULL && "Malloc failed!");
+    s->meta = 1;
+    *slot = s;
+    return s;
+}
+
+// The payload of a slice on the send side
+const char *slice_data(rel_t *r, const slice *s)
+{
+    if (s->data) return s->data->segment;
+    return s->meta ? r->map + s->off : s->segment;
+}
+
+// Empties *slot and gives its slice back to the pool
+void slot_put(slice **slot)
+{
+    slice *s = *slot;
+
+    *slot = NULL;
+    if (!s || s == &slot_received) return;
+    if (s->meta) {
+        free(s);
+        return;
+    }
+    pool.used--;
+    if (pool.nfree < POOL_RESERVE) {
+        s->next = pool.slices;
+        pool.slices = s;
+        pool.nfree++;
+    }
+    else {
+        free(s);
+    }
+}
+
+static struct hist rtt_total;
+static struct hist hold_total;
+
+// rel_output: the decompressed head of a recv_buffer
+static char lz_out[LZ_STAGE];
+
+
+rel_t **rel_hash_slot (const struct sockaddr_storage *ss)
+{
+    rel_t **rp = &rel_hash[addrhash(ss) & (rel_hash_size - 1)];
+    while (*rp && !addreq(&(*rp)->peer, ss)) {
+        rp = &(*rp)->hnext;
+    }
+    return rp;
+}
+
+void rel_hash_insert (rel_t *r)
+{
+    // keep the load factor below one
+    if (rel_hash_count >= rel_hash_size) {
+        rel_t **old = rel_hash;
+        size_t old_size = rel_hash_size;
+
+        rel_hash_size = old_size ? 2 * old_size : 64;
+        rel_hash = calloc(rel_hash_size, sizeof(rel_t*));
+        assert(rel_hash != NULL && "Malloc failed!");
+        for (size_t i = 0; i < old_size; i++) {
+            rel_t *n, *next;
+            for (n = old[i]; n; n = next) {
+                next = n->hnext;
+                rel_t **rp = &rel_hash[addrhash(&n->peer) & (rel_hash_size - 1)];
+                n->hnext = *rp;
+                *rp = n;
+            }
+        }
+        free(old);
+    }
+    rel_t **rp = rel_hash_slot(&r->peer);
+    r->hnext = *rp;
+    *rp = r;
+    rel_hash_count++;
+}
 
 /* Creates a new reliable protocol session, returns NULL on failure.
-* ss is always NULL */
+* ss is the client address on the server, NULL otherwise */
 rel_t * rel_create (conn_t *c, const struct sockaddr_storage *ss, const struct config_common *cc)
 {
-    rel_t *r;
-    r = xmalloc (sizeof (*r));
+    rel_t *r = pool.rels;
+    if (r) {
+        pool.rels = r->next;
+        pool.nrels--;
+    }
+    else {
+        r = xmalloc (sizeof (*r));
+    }
     memset (r, 0, sizeof (*r));
+    pool.limit = (size_t) cc->mem_limit * 1024;
 
     if (!c) {
         c = conn_create (r, ss);
@@ -81,26 +411,73 @@ rel_t * rel_create (conn_t *c, const struct sockaddr_storage *ss, const struct c
     }
 
     r->c    = c;
+    if (ss) {
+        r->peer = *ss;
+        rel_hash_insert(r);
+    }
     r->next = rel_list;
     r->prev = &rel_list;
     if (rel_list) rel_list->prev = &r->next;
     rel_list = r;
 
     r->window_size = cc->window;
+    r->timeout     = (uint64_t) cc->timeout * 1000;
+    r->min_rto     = r->timeout;
+    r->granularity = (uint64_t) cc->timer * 1000;
 
-    r->recv_buffer = calloc( sizeof(slice), r->window_size);
+    r->recv_buffer = calloc( sizeof(slice*), r->window_size);
     assert(r->recv_buffer != NULL && "Malloc failed!");
 
-    r->send_buffer = calloc( sizeof(slice), r->window_size);
+    r->send_buffer = calloc( sizeof(slice*), r->window_size);
     assert(r->send_buffer != NULL && "Malloc failed!");
+    r->active = now_usec();
 
     r->recv_seqno      = 1;
+    r->deliver_seqno   = 1;
+    r->rwnd            = r->window_size;
+
+    r->payload   = cc->payload ? cc->payload : 500;
+    r->ack_every = cc->ack_every ? cc->ack_every : 1;
+    if (r->ack_every > (int) (r->window_size / 2)) r->ack_every = r->window_size / 2;
+    if (r->ack_every < 1) r->ack_every = 1;
     r->send_seqno      = 1;
     r->flags           = 0;
     r->already_written = 0;
     r->eof_seqno = 0;
     SET_LAST_ALLOCATED_ALREADY_SENT(r->flags);
 
+    if (cc->fec) {
+        r->fec_adaptive = cc->fec == FEC_ADAPTIVE;
+        r->fec_group    = r->fec_adaptive ? FEC_MAX_GROUP / 2 : cc->fec;
+        if (r->fec_group > FEC_MAX_GROUP) r->fec_group = FEC_MAX_GROUP;
+        r->fec_loss     = 0.02;
+        r->fec_xor      = calloc(1, 500);
+        assert(r->fec_xor != NULL && "Malloc failed!");
+    }
+
+    r->nstreams = conn_nstreams(c);
+    if (cc->map_input && r->nstreams == 1) {
+        r->map = conn_input_map(c, &r->map_len);
+    }
+    r->no_cksum = cc->no_cksum;
+    if (cc->place_output && r->nstreams == 1) {
+        r->place = conn_output_at(c, NULL, 0, 0) == 0;
+    }
+    if (cc->compress && r->nstreams == 1) {
+        r->lz    = 1;
+    }
+    if (r->nstreams > 1) {
+        r->streams = calloc(r->nstreams, sizeof(stream_state));
+        assert(r->streams != NULL && "Malloc failed!");
+        for (int i = 0; i < r->nstreams; i++) {
+            r->streams[i].next_sseq = 1;
+            r->streams[i].credit    = 1 + STREAM_QUEUE;
+            r->streams[i].expect    = 1;
+            r->streams[i].queue     = calloc(STREAM_QUEUE, sizeof(slice*));
+            assert(r->streams[i].queue != NULL && "Malloc failed!");
+        }
+    }
+
     return r;
 }
 
@@ -110,62 +487,268 @@ void rel_destroy (rel_t *r)
     *r->prev = r->next;
     conn_destroy (r->c);
 
+    if (r->fan && r->fan->group == r) fan_free(r->fan);
+    else if (r->fan) fan_leave(r);
+
+    if (r->peer.ss_family) {
+        *rel_hash_slot(&r->peer) = r->hnext;
+        rel_hash_count--;
+    }
+
     /* Free any other allocated memory here */
+    for (size_t i = 0; i < r->window_size; i++) {
+        slot_put(&r->recv_buffer[i]);
+        slot_put(&r->send_buffer[i]);
+    }
     free(r->recv_buffer);
     free(r->send_buffer);
-    free(r);
+    for (int i = 0; r->streams && i < r->nstreams; i++) {
+        for (int j = 0; j < STREAM_QUEUE; j++) {
+            slot_put(&r->streams[i].queue[j]);
+        }
+        free(r->streams[i].queue);
+    }
+    free(r->streams);
+    free(r->fec_xor);
+    free(r->fec_ring);
+    free(r->lz_in);
+
+    if (pool.nrels < POOL_RELS) {
+        r->next = pool.rels;
+        pool.rels = r;
+        pool.nrels++;
+    }
+    else {
+        free(r);
+    }
+}
+
+// Frees what an idle connection holds besides its windows; it comes
+// back when needed
+void rel_idle(rel_t *r)
+{
+    if (r->lz_in && !r->lz_in_len) {
+        free(r->lz_in);
+        r->lz_in = NULL;
+        r->lz_in_off = 0;
+    }
+    if (r->fec_ring) {
+        free(r->fec_ring);
+        r->fec_ring = NULL;
+        r->fec_ring_size = 0;
+    }
+}
+
+// The slot for seqno in the send window, or NULL if the pool is at its
+// cap and the sender has to wait
+slice *send_slot(rel_t *r, size_t seqno)
+{
+    slice *s = slot_take(&r->send_buffer[seqno % r->window_size], seqno == r->send_seqno);
+
+    if (!s) {
+        if (!r->pool_wait) {
+            STAT_INC(r, pool_waits);
+            r->pool_wait = 1;
+        }
+        return NULL;
+    }
+    r->pool_wait = 0;
+    return s;
 }
 
 
 void rel_recvpkt (rel_t *r, packet_t *pkt, size_t n)
 {
+    STAGE(STAGE_RECVPKT);
+    if (r->dead) {
+        r->active = now_usec();
+        return;
+    }
 
     // network to host endianess
-    uint16_t pkt_len   = ntohs(pkt->len);
+    uint16_t pkt_len   = ntohs(pkt->len) & PKT_LEN_MASK;
+    uint16_t pkt_flags = ntohs(pkt->len) & ~PKT_LEN_MASK;
     uint32_t pkt_ackno = ntohl(pkt->ackno);
     uint16_t pkt_cksum = pkt->cksum;
 
     // check size of packet
-    if( n < 8 || n != pkt_len) return;
+    if( n < 8 || n != pkt_len) {
+        STAT_INC(r, len_fail);
+        return;
+    }
 
-    // verify checksum
+    // verify checksum, unless the peer left it out on a local transport
     pkt->cksum = 0;
-    if(cksum(pkt, n) != pkt_cksum) return;
-    
-    if ( n == 12) {fprintf(stderr, "RECV ackno:%u \nlen:%u \ncksum:%u \nn:%lu\nseqno:%u\n", pkt_ackno, pkt_len, pkt_cksum, n, ntohl(pkt->seqno));}
+    int cksum_ok = pkt_cksum == 0 && r->no_cksum;
+    if (!cksum_ok) {
+        STAGE(STAGE_CKSUM);
+        cksum_ok = cksum(pkt, n) == pkt_cksum;
+    }
+    if (!cksum_ok) {
+        STAT_INC(r, cksum_fail);
+        return;
+    }
+
+    // the peer's hello comes after a plain ack, which it then is
+    if (pkt_flags & PKT_F_HELLO) {
+        struct hello h;
+        if (n != sizeof(struct ack_packet) + sizeof(h) || pkt_flags != PKT_F_HELLO) {
+            STAT_INC(r, len_fail);
+            return;
+        }
+        memcpy(&h, (char*) pkt + sizeof(struct ack_packet), sizeof(h));
+        n = pkt_len = sizeof(struct ack_packet);
+        pkt_flags = 0;
+        if (!r->peer_hello && hello_recv(r, &h) < 0) return;
+    }
+
+    // parity packets carry no ackno
+    if (pkt_flags & PKT_F_PARITY) {
+        fec_recv(r, (struct parity_packet*) pkt, pkt_len);
+        return;
+    }
+
+    if (opt_debug && n == 12) {fprintf(stderr, "RECV ackno:%u \nlen:%u \ncksum:%u \nn:%lu\nseqno:%u\n", pkt_ackno, pkt_len, pkt_cksum, n, ntohl(pkt->seqno));}
 
     // mark acknowledged packets
-    if (r->send_seqno < pkt_ackno) {
-        for (uint16_t i = r->send_seqno; i < pkt_ackno; i++) {
-            slice* s = &(r->send_buffer[i % r->window_size]);
+    int freed = r->send_seqno < pkt_ackno;
+    if (freed) {
+        size_t acked = r->send_seqno;
+        uint64_t now = conn_rxtime(r->c);
+        for (size_t i = r->send_seqno; i < pkt_ackno; i++) {
+            slice* s = SLOT(r->send_buffer[i % r->window_size]);
+            // Karn: a retransmitted packet gives no usable rtt sample
+            if ( s->allocated && s->tx_count == 1 ) {
+                r->fec_loss -= r->fec_loss / 64;
+                hist_record(&r->rtt, now - s->time);
+                hist_record(&rtt_total, now - s->time);
+                // packets behind the head of the window only waited
+                // for it, so only the head says something about its path
+                if (i == r->send_seqno) {
+                    conn_path_feedback(r->c, s->path, now - s->time, 0);
+                    rto_update(r, now - s->time);
+                }
+            }
             if ( s->len < 500 ) {
                 UNSET_SMALL_PACKET_ONLINE(r->flags);
             }
-            s->allocated = 0;
-            s->len = 0;
+            slot_put(&r->send_buffer[i % r->window_size]);
         }
         r->send_seqno = pkt_ackno;
+        if (r->fan) fan_release(r->fan, acked, pkt_ackno);
+        // the peer drained its socket, so there's room again
+        if (r->send_full) send_unsent(r);
     }
 
     // in case of an ack-packet,the function is done
-    if (n == 8) return;
+    if (n == 8) {
+        STAT_INC(r, acks_recv);
+        return;
+    }
+    if (pkt_flags & PKT_F_WINDOW) {
+        struct window_ack *w = (struct window_ack*) pkt;
+        STAT_INC(r, acks_recv);
+        if (n != sizeof(*w)) return;
+        // a reordered ack must not undo what a newer one said
+        if (pkt_ackno < r->send_seqno) return;
+        size_t rwnd = ntohl(w->window);
+        if (!rwnd && r->rwnd) STAT_INC(r, zero_window);
+        r->rwnd = rwnd;
+        if (!EOF_READ(r->flags)) rel_read(r);
+        return;
+    }
+    if (pkt_flags & PKT_F_CREDIT) {
+        uint32_t *credit = (uint32_t*) ((char*) pkt + sizeof(struct ack_packet));
+        int opened = 0;
+        STAT_INC(r, acks_recv);
+        if (r->nstreams < 2 || n != sizeof(struct ack_packet) + 4 * r->nstreams) return;
+        for (int i = 0; i < r->nstreams; i++) {
+            // acks may arrive out of order, credit only grows
+            uint32_t c = ntohl(credit[i]);
+            if ((int32_t) (c - r->streams[i].credit) > 0) {
+                r->streams[i].credit = c;
+                opened = 1;
+            }
+        }
+        // go on with input we left for lack of credit or window
+        if (opened || freed) stream_read(r);
+        return;
+    }
+
 
     // disallow data packets after the EOF if we recieved it already
-    if ( EOF_RECV(r->flags) && ntohl(pkt->seqno) >= r->eof_seqno ) return ;
+    if ( EOF_RECV(r->flags) && ntohl(pkt->seqno) >= r->eof_seqno ) {
+        STAT_INC(r, out_of_window);
+        return;
+    }
 
-    save_pkt_to_file(pkt);
+    if (opt_debug) save_pkt_to_file(pkt);
+
+    // the window moved, go on sending
+    if (freed && !EOF_READ(r->flags)) {
+        rel_read(r);
+    }
 
     // check if seqno is in current window range
     uint32_t pkt_seqno = ntohl(pkt->seqno);
     size_t lower_bound = r->recv_seqno;
-    size_t upper_bound = lower_bound + r-> window_size;
-    if (pkt_seqno < lower_bound || pkt_seqno >= upper_bound ) return;
+    size_t upper_bound = r->deliver_seqno + r->window_size;
+    // our ack for it got lost, so tell the sender again
+    if (pkt_seqno < lower_bound) {
+        STAT_INC(r, dup_dropped);
+        send_ack(r);
+        return;
+    }
+    // maybe a zero window probe, the answer is our current window
+    if (pkt_seqno >= upper_bound) {
+        STAT_INC(r, out_of_window);
+        send_ack(r);
+        return;
+    }
 
     // calculate index in window
     size_t index = pkt_seqno % r->window_size;
 
     // ignore duplicated incoming packets
-    if (r->recv_buffer[index].allocated) return;
+    if (SLOT(r->recv_buffer[index])->allocated) {
+        STAT_INC(r, dup_dropped);
+        return;
+    }
+
+    if (r->nstreams > 1) {
+        if (stream_recv(r, pkt, pkt_seqno, pkt_len)) fec_keep(r, pkt, pkt_len, pkt_flags);
+        return;
+    }
+
+    // from a sender in file mode: write it in place, or skip the offset
+    uint16_t wire_len = pkt_len;
+    const char *payload = pkt->data;
+    if (pkt_flags & PKT_F_OFFSET) {
+        struct data_offset o;
+        if (pkt_len < 12 + sizeof(o)) {
+            STAT_INC(r, len_fail);
+            return;
+        }
+        memcpy(&o, pkt->data, sizeof(o));
+        payload += sizeof(o);
+        pkt_len -= sizeof(o);
+        if (r->place) {
+            uint64_t off = (uint64_t) ntohl(o.hi) << 32 | ntohl(o.lo);
+            if (place_recv(r, payload, pkt_len - 12, pkt_seqno, off)) fec_keep(r, pkt, wire_len, pkt_flags);
+            return;
+        }
+    }
+
+    // out of memory: drop it, unacked, unless the ack point waits for it
+    slice *s = slot_take(&r->recv_buffer[index], pkt_seqno == r->recv_seqno);
+    if (!s) {
+        STAT_INC(r, pool_drops);
+        return;
+    }
+    fec_keep(r, pkt, wire_len, pkt_flags);
+
+    STAT_INC(r, pkts_recv);
+    STAT_ADD(r, bytes_recv, pkt_len - 12);
 
     // store data in window
     if( pkt_len == 12 ){
@@ -173,28 +756,91 @@ void rel_recvpkt (rel_t *r, packet_t *pkt, size_t n)
         r->eof_seqno = ntohl(pkt->seqno);
     }
 
-    memcpy(r->recv_buffer[index].segment, pkt->data, pkt_len - 12);
-    r->recv_buffer[index].len       = pkt_len - 12;
-    r->recv_buffer[index].allocated = 1;
-
-    // initiate data output
-    if (pkt_seqno == r->recv_seqno) {
-        rel_output(r);
+    memcpy(s->segment, payload, pkt_len - 12);
+    s->len       = pkt_len - 12;
+    s->lz        = (pkt_flags & PKT_F_LZ) != 0;
+    s->allocated = 1;
+    s->time      = now_usec();
+    r->active    = s->time;
+
+    // ack what is buffered, whether or not it can be output yet
+    size_t in_order = pkt_seqno == r->recv_seqno;
+    while (r->recv_seqno < r->deliver_seqno + r->window_size &&
+           SLOT(r->recv_buffer[r->recv_seqno % r->window_size])->allocated) {
+        r->recv_seqno++;
     }
+    r->in_recvpkt = 1;
+    rel_output(r);
+    r->in_recvpkt = 0;
+
+    // the ack policy lets in-order packets wait for a few more, as
+    // long as nothing is held back; rel_tick sends the ack otherwise
+    if (in_order && r->deliver_seqno == r->recv_seqno && ++r->unacked < r->ack_every) {
+        STAT_INC(r, acks_delayed);
+        return;
+    }
+    send_ack(r);
 }
 
 
+void rel_demux (const struct config_common *cc,
+                const struct sockaddr_storage *ss,
+                packet_t *pkt, size_t len)
+{
+    STAGE(STAGE_RECVPKT);
+    rel_t *r = rel_hash_size ? *rel_hash_slot(ss) : NULL;
+
+    if (!r) {
+        // only the first data packet of a client opens a connection,
+        // so stray retransmissions of a finished one do not
+        uint16_t pkt_cksum = pkt->cksum;
+        uint16_t pkt_len = ntohs(pkt->len);
+        if (len < 12 || len != (pkt_len & PKT_LEN_MASK) || (pkt_len & PKT_F_HELLO)
+                || ntohl(pkt->seqno) != 1) return;
+        pkt->cksum = 0;
+        if (!(pkt_cksum == 0 && cc->no_cksum) && cksum(pkt, len) != pkt_cksum) return;
+        pkt->cksum = pkt_cksum;
+
+        r = rel_create(NULL, ss, cc);
+        if (!r) return;
+    }
+    rel_recvpkt(r, pkt, len);
+}
+
 void rel_read (rel_t *r)
 {
+    STAGE(STAGE_READ);
+    if (r->dead) return;
+    if (r->fan && r->fan->group == r) {
+        fan_feed(r->fan);
+        return;
+    }
+    if (r->fan) {
+        fan_read(r);
+        return;
+    }
+    if (r->nstreams > 1) {
+        stream_read(r);
+        return;
+    }
+    if (r->map) {
+        map_read(r);
+        return;
+    }
+    if (r->lz && (r->peer_features & HELLO_F_LZ)) {
+        lz_read(r);
+        return;
+    }
+
     slice*   fill_me_up;
     uint16_t available_space;
 
-    size_t upper_bound = r->send_seqno + r->window_size;
+    size_t upper_bound = r->send_seqno + send_window(r);
     size_t first_free  = r->send_seqno;
     size_t newest_seqno;
 
     while ( first_free < upper_bound ) {
-        if ( r->send_buffer[first_free % r->window_size].allocated ) {
+        if ( SLOT(r->send_buffer[first_free % r->window_size])->allocated ) {
             first_free++;
         }
         else {
@@ -203,7 +849,14 @@ void rel_read (rel_t *r)
     }
 
     // no space available
-    if ( r->send_buffer[first_free % r->window_size].allocated ) return;
+    if ( first_free == upper_bound ) {
+        if (!r->stalled) {
+            STAT_INC(r, window_stalls);
+            r->stalled = 1;
+        }
+        return;
+    }
+    r->stalled = 0;
 
     // find packet that  we can fill up with new bytes
     if ( LAST_ALLOCATED_ALREADY_SENT(r->flags) ) {
@@ -213,21 +866,25 @@ void rel_read (rel_t *r)
         newest_seqno = first_free -1;
     }
 
-    fill_me_up = &(r->send_buffer[newest_seqno % r->window_size]);
-    available_space = 500 - fill_me_up->len;
+    fill_me_up = send_slot(r, newest_seqno);
+    if (!fill_me_up) return;
+    available_space = slot_space(r) - fill_me_up->len;
 
     char* begin_writing = (char*) &(fill_me_up->segment) + r->already_written;
     int16_t recieved_bytes = conn_input(r->c, (void *)begin_writing, available_space);
 
-    // nothing to read
-    if (recieved_bytes == 0) return;
+    // nothing to read: an idle reader holds no slice
+    if (recieved_bytes == 0) {
+        if (!fill_me_up->len) slot_put(&r->send_buffer[newest_seqno % r->window_size]);
+        return;
+    }
 
 
     // EOF: Set flag.
     if (recieved_bytes == -1) {
         SET_EOF_READ(r->flags);
-        r->send_buffer[first_free % r->window_size].allocated = 1;
-        fprintf(stderr, 
+        slot_take(&r->send_buffer[first_free % r->window_size], 1)->allocated = 1;
+        if (opt_debug) fprintf(stderr, 
             "EOF_READ.\n EOF_RECEIVED: %s \nAlready written: %lu\n EOF_READ: %s\n ALL_WRITTEN: %s\nRECV_SEQNO: %lu\n", 
             EOF_RECV(r->flags) ? "True" : "False",  
             r->already_written,
@@ -244,7 +901,7 @@ void rel_read (rel_t *r)
     fill_me_up->len += recieved_bytes;
 
     // Send if it's possible.
-    if (fill_me_up->len == 500 || (!SMALL_PACKET_ONLINE(r->flags) && fill_me_up->len != 0)) {
+    if (fill_me_up->len == slot_space(r) || (!SMALL_PACKET_ONLINE(r->flags) && fill_me_up->len != 0)) {
         SET_LAST_ALLOCATED_ALREADY_SENT(r->flags);
         send_packet(r, newest_seqno);
     }
@@ -254,43 +911,866 @@ void rel_read (rel_t *r)
     }
 }
 
-void send_ack(rel_t *r) {
-    struct ack_packet pkt;
+// The checksum to send, 0 for none with -K.  cksum() never gives 0.
+uint16_t pkt_cksum(rel_t *r, const void *pkt, int len)
+{
+    return r->no_cksum ? 0 : cksum(pkt, len);
+}
+
+// RFC 6298: timeout follows the smoothed rtt and its variation, but
+// never goes below -t
+void rto_update(rel_t *r, uint64_t rtt)
+{
+    if (!r->srtt) {
+        r->srtt   = rtt;
+        r->rttvar = rtt / 2;
+    }
+    else {
+        uint64_t err = r->srtt > rtt ? r->srtt - rtt : rtt - r->srtt;
+        r->rttvar = (3 * r->rttvar + err) / 4;
+        r->srtt   = (7 * r->srtt + rtt) / 8;
+    }
+    uint64_t rto = r->srtt + (4 * r->rttvar > r->granularity ? 4 * r->rttvar : r->granularity);
+    if (rto > 60000000) rto = 60000000;
+    r->timeout = rto > r->min_rto ? rto : r->min_rto;
+}
+
+// Payload that fits a data packet, next to the offset in file mode
+size_t slot_space(rel_t *r)
+{
+    return r->map ? r->payload - sizeof(struct data_offset) : r->payload;
+}
+
+// Introduce us: a plain ack with our hello behind it, which a peer
+// without hellos drops as malformed
+void hello_send(rel_t *r)
+{
+    struct {
+        struct ack_packet a;
+        struct hello h;
+    } pkt;
+    uint32_t features = HELLO_F_WINDOW | HELLO_F_FEC | HELLO_F_LZ | HELLO_F_OFFSET;
+
+    if (r->nstreams > 1) features |= HELLO_F_STREAMS;
+    pkt.h.version   = htons(HELLO_VERSION);
+    pkt.h.payload   = htons(r->payload);
+    pkt.h.window    = htonl(r->window_size);
+    pkt.h.features  = htonl(features);
+    pkt.h.nstreams  = htons(r->nstreams);
+    pkt.h.ack_every = htons(r->ack_every);
+
+    pkt.a.cksum = 0;
+    pkt.a.len   = htons(sizeof(pkt) | PKT_F_HELLO);
+    pkt.a.ackno = htonl(r->recv_seqno);
+    pkt.a.cksum = pkt_cksum(r, &pkt, sizeof(pkt));
+    conn_sendpkt(r->c, (packet_t*) &pkt, sizeof(pkt));
+    r->hellos++;
+}
+
+// Agree with the peer: the smaller window, payload and ack interval,
+// and the features both have.  Returns -1 if we cannot talk to it, in
+// which case r is gone, or dead on the server.
+//
+// The buffers keep the size rel_create gave them: they are slot
+// pointers filled from the pool as packets come, so the part of them
+// past the agreed window costs a pointer a slot, and both sides stay
+// inside it anyway, the sender through rwnd.  Resizing them would mean
+// moving whatever is in flight by now.
+int hello_recv(rel_t *r, const struct hello *h)
+{
+    size_t window  = ntohl(h->window);
+    size_t payload = ntohs(h->payload);
+    int ack_every  = ntohs(h->ack_every);
+
+    if (ntohs(h->version) != HELLO_VERSION) {
+        fprintf(stderr, "%s: peer speaks hello version %u, we %d\n",
+                progname, ntohs(h->version), HELLO_VERSION);
+        if (r->peer.ss_family) r->dead = 1;
+        else rel_destroy(r);
+        return -1;
+    }
+    if (ntohs(h->nstreams) != r->nstreams) {
+        fprintf(stderr, "%s: peer has %u streams, we have %d\n",
+                progname, ntohs(h->nstreams), r->nstreams);
+        // on the server, each retransmission of the peer's first
+        // packet would make the connection anew
+        if (r->peer.ss_family) r->dead = 1;
+        else rel_destroy(r);
+        return -1;
+    }
+    r->peer_hello    = 1;
+    r->peer_features = ntohl(h->features);
+    // packets that may have gone out already keep going without
+    if (r->peer_features & HELLO_F_OFFSET) {
+        r->offset_from = r->send_seqno + r->window_size;
+    }
+    if (window && window < r->rwnd) r->rwnd = window;
+    if (payload >= 64 && payload < r->payload) r->payload = payload;
+    if (ack_every >= 1 && ack_every < r->ack_every) r->ack_every = ack_every;
+    return 0;
+}
+
+// How far past send_seqno we may send: our window, narrowed to what
+// the peer advertised.  A closed window still lets one packet out,
+// which the retransmit timer then repeats as a zero window probe.
+size_t send_window(rel_t *r)
+{
+    size_t w = r->rwnd < r->window_size ? r->rwnd : r->window_size;
+    return w ? w : 1;
+}
+
+// The window we advertise: free recv_buffer slots past the ack point,
+// but no more than conn_output can take while output is backed up.
+size_t recv_window(rel_t *r)
+{
+    size_t window = r->deliver_seqno + r->window_size - r->recv_seqno;
+
+    if (r->deliver_seqno < r->recv_seqno) {
+        size_t room = conn_bufspace(r->c) / r->payload;
+        if (room < window) window = room;
+    }
+    // what the pool has left, shared with everyone else
+    if (pool.limit) {
+        size_t room = pool.limit / SLICE_SIZE;
+        room = room > pool.used ? room - pool.used : 0;
+        if (room < window) window = room;
+    }
+    return window;
+}
+
+// The first free slot of the send window, or 0 (and a stall) if the
+// window is full.
+size_t free_seqno(rel_t *r)
+{
+    size_t seqno = r->send_seqno;
+    size_t upper_bound = r->send_seqno + send_window(r);
+
+    while (seqno < upper_bound &&
+           SLOT(r->send_buffer[seqno % r->window_size])->allocated) {
+        seqno++;
+    }
+    if (seqno == upper_bound) {
+        if (!r->stalled) {
+            STAT_INC(r, window_stalls);
+            r->stalled = 1;
+        }
+        return 0;
+    }
+    r->stalled = 0;
+    return seqno;
+}
+
+// File send mode: fill every free slot of the window with the next
+// piece of the mapping; only where it is goes into the slot
+void map_read(rel_t *r)
+{
+    while (!EOF_READ(r->flags)) {
+        size_t seqno = free_seqno(r);
+        if (!seqno) return;
+
+        slice *s = slot_take_meta(&r->send_buffer[seqno % r->window_size]);
+        size_t len = r->map_len - r->map_off;
+        if (len > slot_space(r)) len = slot_space(r);
+
+        s->off = r->map_off;
+        s->len = len;
+        s->allocated = 1;
+        r->map_off += len;
+        if (!len) SET_EOF_READ(r->flags);
+        send_packet(r, seqno);
+    }
+}
+
+/* Fan-out: r, on a connection with the input and no network, becomes
+ * a group that reads the input once for the members that join it.
+ * lag is how many packets it holds for the slowest member; with drop,
+ * a member that falls further behind is cut off instead of waited
+ * for.  The group writes no output. */
+void rel_fanout (rel_t *r, size_t lag, int drop)
+{
+    fanout *f = xmalloc(sizeof(*f));
+    memset(f, 0, sizeof(*f));
+
+    // a member only reads for seqno head while its window starts past
+    // base, so the ring needs a window at least, see fan_cut
+    f->size  = lag > r->window_size ? lag : r->window_size;
+    f->ring  = calloc(f->size, sizeof(slice*));
+    assert(f->ring != NULL && "Malloc failed!");
+    f->group = r;
+    f->base  = 1;
+    f->head  = 1;
+    f->drop  = drop;
+    r->fan   = f;
+    conn_output(r->c, NULL, 0);
+}
+
+/* Fan-out: r becomes a member of group, before it reads anything */
+void rel_fanout_join (rel_t *group, rel_t *r)
+{
+    fanout *f = group->fan;
+
+    assert(f->head == 1 && "Members join before the group reads");
+    f->members = realloc(f->members, (f->nmembers + 1) * sizeof(rel_t*));
+    assert(f->members != NULL && "Malloc failed!");
+    f->members[f->nmembers++] = r;
+    r->fan = f;
+}
+
+// Fan-out, -G drop: cuts off the members that hold back the oldest
+// packet of a full ring.  They go at their next tick; until then they
+// send nothing.  Returns whether that made room.
+int fan_cut(fanout *f)
+{
+    // base moves on as they go
+    size_t base = f->base;
+
+    for (int i = f->nmembers - 1; i >= 0; i--) {
+        rel_t *m = f->members[i];
+        if (m->send_seqno > base) continue;
+
+        fprintf(stderr, "%s: fan-out: cut off a receiver %lu packets behind\n",
+                progname, f->head - m->send_seqno);
+        STAT_INC(f->group, lag_drops);
+        fan_leave(m);
+        for (size_t j = 0; j < m->window_size; j++) {
+            slot_put(&m->send_buffer[j]);
+        }
+        SET_EOF_READ(m->flags);
+        m->cut = 1;
+    }
+    return f->head - f->base < f->size;
+}
+
+// Fan-out: reads the packet for seqno head into the ring.  Returns 0
+// without input, at the memory cap, or when the ring is full because
+// the slowest member is the whole ring behind; the members waiting
+// for it are fed once it moves on.
+int fan_fill(fanout *f)
+{
+    rel_t *g = f->group;
+
+    if (f->eof) return 0;
+    if (f->head - f->base == f->size && !(f->drop && fan_cut(f))) {
+        if (!f->starved) {
+            STAT_INC(g, lag_waits);
+            f->starved = 1;
+        }
+        return 0;
+    }
+
+    slice **slot = &f->ring[f->head % f->size];
+    slice *s = slot_take(slot, f->head == f->base);
+    if (!s) {
+        if (!g->pool_wait) {
+            STAT_INC(g, pool_waits);
+            g->pool_wait = 1;
+        }
+        return 0;
+    }
+    g->pool_wait = 0;
+
+    int n = conn_input(g->c, s->segment, slot_space(g));
+    if (n == 0) {
+        slot_put(slot);
+        return 0;
+    }
+    if (n < 0) {
+        f->eof = 1;
+        n = 0;
+    }
+    s->len       = n;
+    s->allocated = 1;
+    s->refs      = f->nmembers;
+    g->active    = now_usec();
+    f->head++;
+    return 1;
+}
+
+// Fan-out: a member's rel_read.  Its free window slots take the
+// packets the group has read, and for the first member past those
+// the group reads on.  After a full socket, the rest waits for
+// send_unsent, so the receiver gets no packets past a hole.
+void fan_read(rel_t *r)
+{
+    fanout *f = r->fan;
+
+    while (!EOF_READ(r->flags) && !r->send_full) {
+        size_t seqno = free_seqno(r);
+        if (!seqno) return;
+        if (seqno == f->head && !fan_fill(f)) return;
+
+        slice *s = slot_take_meta(&r->send_buffer[seqno % r->window_size]);
+        s->data      = f->ring[seqno % f->size];
+        s->len       = s->data->len;
+        s->allocated = 1;
+        if (!s->len) SET_EOF_READ(r->flags);
+        send_packet(r, seqno);
+    }
+}
+
+// Fan-out: every member takes what its window has room for.  A member
+// cut off on the way swaps the last one, which was fed already, in.
+void fan_feed(fanout *f)
+{
+    for (int i = f->nmembers - 1; i >= 0; i--) {
+        if (i < f->nmembers) fan_read(f->members[i]);
+    }
+}
+
+// Fan-out: a member no longer needs seqnos from up to to.  A shared
+// slice goes back to the pool with the last member.
+void fan_release(fanout *f, size_t from, size_t to)
+{
+    size_t base = f->base;
+
+    if (to > f->head) to = f->head;
+    for (size_t seqno = from; seqno < to; seqno++) {
+        slice **slot = &f->ring[seqno % f->size];
+        if (*slot && !--(*slot)->refs) slot_put(slot);
+    }
+    // members release in order, so the ring empties from base on
+    while (f->base < f->head && !f->ring[f->base % f->size]) {
+        f->base++;
+    }
+    if (f->base > base && f->starved) {
+        f->starved = 0;
+        fan_feed(f);
+    }
+}
+
+// Fan-out: member r leaves its group with what it held
+void fan_leave(rel_t *r)
+{
+    fanout *f = r->fan;
+
+    r->fan = NULL;
+    for (int i = 0; i < f->nmembers; i++) {
+        if (f->members[i] == r) {
+            f->members[i] = f->members[--f->nmembers];
+            break;
+        }
+    }
+    fan_release(f, r->send_seqno, f->head);
+}
+
+void fan_free(fanout *f)
+{
+    for (int i = 0; i < f->nmembers; i++) {
+        f->members[i]->fan = NULL;
+    }
+    for (size_t i = 0; i < f->size; i++) {
+        slot_put(&f->ring[i]);
+    }
+    f->group->fan = NULL;
+    free(f->ring);
+    free(f->members);
+    free(f);
+}
+
+// Direct placement: write a new data packet to the output file where
+// it belongs, so nothing waits in memory for the packets before it.
+// The recv_buffer slot only marks it as received.  Packets the sender
+// sent before it knew we take offsets come without and are buffered
+// and written in order by rel_output, which steps over the marks.
+// Returns 0 if the packet was dropped.
+int place_recv(rel_t *r, const char *data, uint16_t len, uint32_t seqno, uint64_t off)
+{
+    if (len == 0) {
+        SET_EOF_RECV(r->flags);
+        r->eof_seqno = seqno;
+    }
+    else if (conn_output_at(r->c, data, len, off) < 0) {
+        // cannot write it now: drop it, the retransmission tries again
+        STAT_INC(r, outbuf_full);
+        return 0;
+    }
+    STAT_INC(r, pkts_recv);
+    STAT_ADD(r, bytes_recv, len);
+    r->active = now_usec();
+
+    r->recv_buffer[seqno % r->window_size] = &slot_received;
+    while (r->recv_seqno < r->deliver_seqno + r->window_size &&
+           SLOT(r->recv_buffer[r->recv_seqno % r->window_size])->allocated) {
+        r->recv_seqno++;
+    }
+    r->in_recvpkt = 1;
+    rel_output(r);
+    r->in_recvpkt = 0;
+    send_ack(r);
+    return 1;
+}
+
+// Compression: stage up to LZ_STAGE bytes of input and cut them into
+// packets, each compressed on its own so that it decodes without the
+// others.  What does not shrink goes out as it is.
+void lz_read(rel_t *r)
+{
+    if (EOF_READ(r->flags)) return;
+
+    if (!r->lz_in) {
+        r->lz_in = malloc(LZ_STAGE);
+        assert(r->lz_in != NULL && "Malloc failed!");
+    }
+    if (!r->lz_eof && r->lz_in_len < LZ_STAGE) {
+        memmove(r->lz_in, r->lz_in + r->lz_in_off, r->lz_in_len);
+        r->lz_in_off = 0;
+        int n = conn_input(r->c, r->lz_in + r->lz_in_len, LZ_STAGE - r->lz_in_len);
+        if (n < 0) r->lz_eof = 1;
+        else r->lz_in_len += n;
+    }
+
+    while (r->lz_in_len || r->lz_eof) {
+        size_t seqno = free_seqno(r);
+        if (!seqno) return;
+        slice *s = send_slot(r, seqno);
+        if (!s) return;
+        char *in = r->lz_in + r->lz_in_off;
+        size_t used = 0, n = 0;
+
+        if (!r->lz_in_len) {
+            s->len = 0;
+            s->lz = 0;
+            s->allocated = 1;
+            SET_EOF_READ(r->flags);
+            send_packet(r, seqno);
+            return;
+        }
+
+        size_t space = slot_space(r);
+        if (r->lz_skip) r->lz_skip--;
+        else n = lz_compress(in, r->lz_in_len, s->segment, space, &used);
+
+        if (n && n < used) {
+            s->lz = 1;
+            s->len = n;
+            STAT_ADD(r, lz_saved, used - n);
+        }
+        else {
+            if (n && r->lz_in_len >= space) r->lz_skip = LZ_SKIP;
+            used = r->lz_in_len < space ? r->lz_in_len : space;
+            memcpy(s->segment, in, used);
+            s->lz = 0;
+            s->len = used;
+        }
+        r->lz_in_off += used;
+        r->lz_in_len -= used;
+        s->allocated = 1;
+        send_packet(r, seqno);
+    }
+}
+
+// Multi-stream: send what the streams have, round robin, as long as
+// the window and each stream's credit allow.  Unlike rel_read this
+// sends right away; a small packet on one stream must not wait for
+// the others.
+void stream_read(rel_t *r)
+{
+    int progress = 1;
+
+    if (EOF_READ(r->flags)) return;
+
+    while (progress) {
+        progress = 0;
+        for (int k = 0; k < r->nstreams; k++) {
+            int sid = (r->next_stream + k) % r->nstreams;
+            stream_state *st = &r->streams[sid];
+
+            if (st->eof_read || (int32_t) (st->next_sseq - st->credit) >= 0) continue;
+
+            size_t seqno = free_seqno(r);
+            if (!seqno) return;
+
+            slice *s = send_slot(r, seqno);
+            if (!s) return;
+            struct stream_hdr *h = (struct stream_hdr*) s->segment;
+            int n = conn_stream_input(r->c, sid, s->segment + sizeof(*h), slot_space(r) - sizeof(*h));
+            if (n == 0) {
+                slot_put(&r->send_buffer[seqno % r->window_size]);
+                continue;
+            }
+
+            h->stream = htons(sid);
+            h->flags  = htons(n < 0 ? STREAM_EOF : 0);
+            h->sseq   = htonl(st->next_sseq++);
+            if (n < 0) {
+                st->eof_read = 1;
+                n = 0;
+            }
+            s->len = sizeof(*h) + n;
+            s->allocated = 1;
+            send_packet(r, seqno);
+            r->next_stream = (sid + 1) % r->nstreams;
+            progress = 1;
+        }
+    }
+
+    // all streams ended, now end the connection
+    for (int i = 0; i < r->nstreams; i++) {
+        if (!r->streams[i].eof_read) return;
+    }
+    size_t seqno = free_seqno(r);
+    slice *s = seqno ? send_slot(r, seqno) : NULL;
+    if (s) {
+        s->len = 0;
+        s->allocated = 1;
+        SET_EOF_READ(r->flags);
+        send_packet(r, seqno);
+    }
+}
+
+// Multi-stream: a new data packet within the window.  Its data goes to
+// the queue of its stream, so the recv_buffer slot only marks it as
+// received and the cumulative ack moves on without waiting for
+// delivery.  Returns 0 if the packet was dropped.
+int stream_recv(rel_t *r, packet_t *pkt, uint32_t pkt_seqno, uint16_t pkt_len)
+{
+    if (pkt_len == 12) {
+        SET_EOF_RECV(r->flags);
+        r->eof_seqno = pkt_seqno;
+    }
+    else {
+        struct stream_hdr *h = (struct stream_hdr*) pkt->data;
+        if (pkt_len < 12 + sizeof(*h) || ntohs(h->stream) >= r->nstreams) {
+            STAT_INC(r, len_fail);
+            return 0;
+        }
+        stream_state *st = &r->streams[ntohs(h->stream)];
+        uint32_t sseq = ntohl(h->sseq);
+
+        // beyond the credit we gave: drop it, unacked
+        if ((int32_t) (sseq - st->expect) >= STREAM_QUEUE) {
+            STAT_INC(r, out_of_window);
+            return 0;
+        }
+        if ((int32_t) (sseq - st->expect) >= 0) {
+            slice *q = slot_take(&st->queue[sseq % STREAM_QUEUE], sseq == st->expect);
+            if (!q) {
+                STAT_INC(r, pool_drops);
+                return 0;
+            }
+            memcpy(q->segment, pkt->data, pkt_len - 12);
+            q->len       = pkt_len - 12;
+            q->allocated = 1;
+            q->time      = now_usec();
+        }
+    }
+
+    STAT_INC(r, pkts_recv);
+    STAT_ADD(r, bytes_recv, pkt_len - 12);
+
+    r->active = now_usec();
+    r->recv_buffer[pkt_seqno % r->window_size] = &slot_received;
+    while (SLOT(r->recv_buffer[r->recv_seqno % r->window_size])->allocated) {
+        slot_put(&r->recv_buffer[r->recv_seqno % r->window_size]);
+        r->recv_seqno++;
+    }
+    r->deliver_seqno = r->recv_seqno;
+    if (!stream_output(r)) send_ack(r);
+    return 1;
+}
+
+// Multi-stream: hand every stream what it has in order and ack with
+// the credits this opened.  Returns non-zero if it sent that ack.
+int stream_output(rel_t *r)
+{
+    int done = 1;
+    int delivered = 0;
+
+    for (int sid = 0; sid < r->nstreams; sid++) {
+        stream_state *st = &r->streams[sid];
+
+        for (;;) {
+            slice *q = SLOT(st->queue[st->expect % STREAM_QUEUE]);
+            struct stream_hdr *h = (struct stream_hdr*) q->segment;
+            if (!q->allocated || ntohl(h->sseq) != st->expect) break;
+
+            if (ntohs(h->flags) & STREAM_EOF) {
+                conn_stream_output(r->c, sid, NULL, 0);
+                st->eof_written = 1;
+            }
+            else {
+                size_t left = q->len - sizeof(*h) - st->already_written;
+                int written = conn_stream_output(r->c, sid, q->segment + sizeof(*h) + st->already_written, left);
+                if (written < 0) written = 0;
+                if ((size_t) written < left) {
+                    STAT_INC(r, outbuf_full);
+                    st->already_written += written;
+                    break;
+                }
+                uint64_t held = now_usec() - q->time;
+                hist_record(&r->hold, held);
+                hist_record(&hold_total, held);
+            }
+            slot_put(&st->queue[st->expect % STREAM_QUEUE]);
+            st->already_written = 0;
+            st->expect++;
+            delivered = 1;
+        }
+        if (!st->eof_written) done = 0;
+    }
+
+    if (delivered) send_ack(r);
+
+    if (done && EOF_RECV(r->flags) && r->recv_seqno > r->eof_seqno) {
+        SET_ALL_WRITTEN(r->flags);
+    }
+    return delivered;
+}
+
+// FEC: fold a first transmission into the parity of its group.  A
+// group is a run of consecutive seqnos; its size follows the loss rate
+// in adaptive mode, aiming for about one loss per four groups.
+void fec_add(rel_t *r, uint32_t seqno, const char *data, uint16_t len, uint16_t flags)
+{
+    if (r->fec_count && seqno != r->fec_first + r->fec_count) fec_flush(r);
+
+    if (!r->fec_count) {
+        r->fec_first   = seqno;
+        r->fec_len_xor = 0;
+        r->fec_maxlen  = 0;
+        memset(r->fec_xor, 0, 500);
+    }
+    for (int i = 0; i < len; i++) {
+        r->fec_xor[i] ^= data[i];
+    }
+    r->fec_len_xor ^= len | flags;
+    if (len > r->fec_maxlen) r->fec_maxlen = len;
+    r->fec_count++;
+
+    if (r->fec_adaptive) {
+        double n = 0.25 / r->fec_loss;
+        r->fec_group = n < 2 ? 2 : n > FEC_MAX_GROUP ? FEC_MAX_GROUP : (int) n;
+    }
+    if (r->fec_count >= r->fec_group) fec_flush(r);
+}
+
+// FEC: keep a copy of a data packet the receiver took in, for
+// rebuilding a lost packet of its group from the parity
+void fec_keep(rel_t *r, const packet_t *pkt, uint16_t pkt_len, uint16_t pkt_flags)
+{
+    if (!r->fec_ring) return;
+    fec_entry *e = &r->fec_ring[ntohl(pkt->seqno) % r->fec_ring_size];
+    e->seqno = ntohl(pkt->seqno);
+    e->len   = pkt_len - 12;
+    e->flags = pkt_flags & (PKT_F_LZ | PKT_F_OFFSET);
+    memcpy(e->data, pkt->data, e->len);
+}
+
+void fec_flush(rel_t *r)
+{
+    struct parity_packet pkt;
+    uint16_t len = 12 + r->fec_maxlen;
+
+    if (!r->fec_count) return;
+
+    pkt.cksum   = 0;
+    pkt.len     = htons(len | PKT_F_PARITY);
+    pkt.count   = htons(r->fec_count);
+    pkt.len_xor = htons(r->fec_len_xor);
+    pkt.seqno   = htonl(r->fec_first);
+    memcpy(pkt.data, r->fec_xor, r->fec_maxlen);
+    pkt.cksum = pkt_cksum(r, &pkt, len);
+    conn_sendpkt(r->c, (packet_t*) &pkt, len);
+
+    STAT_INC(r, fec_sent);
+    r->fec_count = 0;
+}
+
+// FEC: if exactly one packet of the group is missing, rebuild it and
+// take it in as if it had arrived.
+void fec_recv(rel_t *r, struct parity_packet *p, uint16_t len)
+{
+    uint32_t first = ntohl(p->seqno);
+    uint16_t count = ntohs(p->count);
+    uint16_t rebuilt_len = ntohs(p->len_xor);
+    uint32_t missing = 0;
+    packet_t pkt;
+
+    if (count == 0 || count > FEC_MAX_GROUP || len < 12) {
+        STAT_INC(r, len_fail);
+        return;
+    }
+    if (!r->fec_ring) {
+        r->fec_ring_size = r->window_size + FEC_MAX_GROUP;
+        r->fec_ring = calloc(r->fec_ring_size, sizeof(fec_entry));
+        assert(r->fec_ring != NULL && "Malloc failed!");
+        return;
+    }
+
+    for (uint32_t seqno = first; seqno < first + count; seqno++) {
+        if (r->fec_ring[seqno % r->fec_ring_size].seqno == seqno) continue;
+        // received before we kept copies, or long gone
+        if (seqno < r->recv_seqno || missing) return;
+        missing = seqno;
+    }
+    if (!missing) return;
+
+    memcpy(pkt.data, p->data, len - 12);
+    memset(pkt.data + len - 12, 0, 500 - (len - 12));
+    for (uint32_t seqno = first; seqno < first + count; seqno++) {
+        fec_entry *e = &r->fec_ring[seqno % r->fec_ring_size];
+        if (seqno == missing) continue;
+        for (int i = 0; i < e->len; i++) {
+            pkt.data[i] ^= e->data[i];
+        }
+        rebuilt_len ^= e->len | e->flags;
+    }
+    uint16_t flags = rebuilt_len & ~PKT_LEN_MASK;
+    rebuilt_len &= PKT_LEN_MASK;
+    if (rebuilt_len > len - 12 || (flags & ~(PKT_F_LZ | PKT_F_OFFSET))) return;
 
     pkt.cksum = 0;
-    pkt.len   = htons(8);
-    pkt.ackno = htonl(r->recv_seqno);
+    pkt.len   = htons((12 + rebuilt_len) | flags);
+    pkt.ackno = htonl(r->send_seqno);
+    pkt.seqno = htonl(missing);
+    pkt.cksum = cksum(&pkt, 12 + rebuilt_len);
+    STAT_INC(r, fec_recovered);
+    rel_recvpkt(r, &pkt, 12 + rebuilt_len);
+}
 
-    // compute checksum
-    pkt.cksum = cksum(&pkt, 8);
-    conn_sendpkt(r->c, (packet_t*) &pkt, 8);
+void send_ack(rel_t *r) {
+    struct window_ack w;
+    uint16_t len = sizeof(w);
+
+    r->unacked = 0;
+
+    if (r->nstreams > 1 && (r->peer_features & HELLO_F_STREAMS)) {
+        // header, then a credit per stream
+        union {
+            packet_t p;
+            char buf[sizeof(struct ack_packet) + 4 * MAX_STREAMS];
+        } cpkt;
+        struct ack_packet a;
+        uint16_t len = sizeof(a) + 4 * r->nstreams;
+
+        for (int i = 0; i < r->nstreams; i++) {
+            uint32_t credit = htonl(r->streams[i].expect + STREAM_QUEUE);
+            memcpy(cpkt.buf + sizeof(a) + 4 * i, &credit, 4);
+        }
+        a.cksum = 0;
+        a.len   = htons(len | PKT_F_CREDIT);
+        a.ackno = htonl(r->recv_seqno);
+        memcpy(cpkt.buf, &a, sizeof(a));
+        a.cksum = pkt_cksum(r, cpkt.buf, len);
+        memcpy(cpkt.buf, &a.cksum, sizeof(a.cksum));
+        conn_sendpkt(r->c, &cpkt.p, len);
+        STAT_INC(r, acks_sent);
+        r->credit_sent = now_usec();
+    }
+    // a peer that did not announce window acks gets the plain 8 bytes
+    else if (r->nstreams > 1 || !(r->peer_features & HELLO_F_WINDOW)) {
+        struct ack_packet a;
+        a.cksum = 0;
+        a.len   = htons(sizeof(a));
+        a.ackno = htonl(r->recv_seqno);
+        a.cksum = pkt_cksum(r, &a, sizeof(a));
+        conn_sendpkt(r->c, (packet_t*) &a, sizeof(a));
+        STAT_INC(r, acks_sent);
+    }
+    else {
+        w.cksum  = 0;
+        w.len    = htons(len | PKT_F_WINDOW);
+        w.ackno  = htonl(r->recv_seqno);
+        w.window = htonl(recv_window(r));
+        w.cksum  = pkt_cksum(r, &w, len);
+        conn_sendpkt(r->c, (packet_t*) &w, len);
+        STAT_INC(r, acks_sent);
+    }
+    if (r->hellos < HELLOS) hello_send(r);
 }
 
 void send_packet(rel_t *r, uint32_t seq_no) {
+    STAGE(STAGE_SEND);
     packet_t pkt;
-    slice *s = &(r->send_buffer[seq_no % r->window_size]);
+    slice *s = r->send_buffer[seq_no % r->window_size];
+
+    uint16_t flags = s->lz ? PKT_F_LZ : 0;
+    size_t len = s->len;
+
+    // file mode: tell the receiver where the data goes, once it said
+    // it takes offsets; a seqno goes out the same way every time
+    char *data = pkt.data;
+    if (s->meta && !s->data && r->offset_from && seq_no >= r->offset_from) {
+        struct data_offset o = { htonl(s->off >> 32), htonl(s->off) };
+        memcpy(data, &o, sizeof(o));
+        len += sizeof(o);
+        flags |= PKT_F_OFFSET;
+    }
+    memcpy(data + len - s->len, slice_data(r, s), s->len);
 
     pkt.cksum = 0;
-    pkt.len   = htons(s->len + 12);
+    pkt.len   = htons((len + 12) | flags);
     pkt.seqno = htonl(seq_no);
     pkt.ackno = htonl(r->recv_seqno);
-    memcpy(pkt.data, s->segment, s->len);
-    pkt.cksum = cksum(&pkt, s->len + 12);
+    pkt.cksum = pkt_cksum(r, &pkt, len + 12);
 
     //fprintf(stderr, "SEND PKT: len:%u seqno:%u ackno:%lu segment:%s cksum:%u\n", s->len, seq_no, r->recv_seqno, pkt.data, pkt.cksum);
 
-    conn_sendpkt(r->c, &pkt, s->len + 12);
+    // a full socket (a unix peer's queue holds only a few datagrams)
+    // isn't a loss: leave it unsent and rel_tick tries it again
+    if (conn_sendpkt(r->c, &pkt, len + 12) < 0 && errno == EAGAIN) {
+        STAT_INC(r, send_full);
+        r->send_full = 1;
+        return;
+    }
+
+    STAT_INC(r, pkts_sent);
+    STAT_ADD(r, bytes_sent, s->len);
+    if (s->tx_count) STAT_INC(r, retransmits);
+    else if (r->fec_group && (r->peer_features & HELLO_F_FEC)) {
+        fec_add(r, seq_no, data, len, flags & (PKT_F_LZ | PKT_F_OFFSET));
+    }
+    if (s->tx_count < UINT8_MAX) s->tx_count++;
+    s->time = now_usec();
+    s->path = conn_lastpath(r->c);
+    r->active = s->time;
+    if (r->hellos < HELLOS) hello_send(r);
 }
 
 void rel_output (rel_t *r)
 {
+    STAGE(STAGE_OUTPUT);
     char ack_afterwards = 0;
 
-    while( r->recv_buffer[r->recv_seqno % r->window_size].allocated) {
+    if (r->nstreams > 1) {
+        (void) stream_output(r);
+        return;
+    }
+
+    while( r->deliver_seqno < r->recv_seqno && !r->lz_bad ) {
         
-        slice* s = &(r->recv_buffer[r->recv_seqno % r->window_size]);
+        slice* s = r->recv_buffer[r->deliver_seqno % r->window_size];
+        const char *data = s->segment;
+        size_t len = s->len;
+
+        // written in place already; only its EOF is left to pass on
+        if (s == &slot_received) {
+            if (EOF_RECV(r->flags) && r->deliver_seqno == r->eof_seqno) {
+                conn_output(r->c, NULL, 0);
+            }
+            slot_put(&r->recv_buffer[r->deliver_seqno % r->window_size]);
+            r->deliver_seqno++;
+            continue;
+        }
+
+        // decompressed again after a partial write, it is stateless
+        if (s->lz) {
+            int n = lz_decompress(s->segment, s->len, lz_out, sizeof(lz_out));
+            if (n <= 0) {
+                // passed the checksum, so the peer sent garbage; it is
+                // acked already, so rather than leave a gap in the
+                // output, stop here and let rel_tick end the connection
+                STAT_INC(r, len_fail);
+                fprintf(stderr, "%s: packet %lu does not decompress, giving up\n",
+                        progname, r->deliver_seqno);
+                r->lz_bad = 1;
+                break;
+            }
+            data = lz_out;
+            len  = n;
+        }
 
-        if(s->len - r->already_written == 0) { 
+        if(opt_debug && len - r->already_written == 0) { 
             fprintf(stderr, 
             "conn_output will be called with a length of zero now.\n EOF_RECEIVED: %s \nAlready written: %lu\n EOF_READ: %s\n ALL_WRITTEN: %s\nRECV_SEQNO: %lu\n", 
             EOF_RECV(r->flags) ? "True" : "False",  
@@ -300,12 +1780,8 @@ void rel_output (rel_t *r)
             r->recv_seqno
             ); 
         }
-        size_t written = conn_output(
-                                        r->c,
-                                        &(s->segment) + r->already_written ,
-                                        s->len - r->already_written
-                                    );
-        if(s->len - r->already_written == 0) { 
+        size_t written = conn_output(r->c, data + r->already_written, len - r->already_written);
+        if(opt_debug && len - r->already_written == 0) { 
             fprintf(stderr, 
             "conn_output was called with a length of zero just before now.\n EOF_RECEIVED: %s \nAlready written: %lu\n EOF_READ: %s\n ALL_WRITTEN: %s\n, Written: %lu\n", 
             EOF_RECV(r->flags) ? "True" : "False",  
@@ -316,28 +1792,32 @@ void rel_output (rel_t *r)
             ); 
         }                          
         
-        if (written == s->len - r->already_written) {
+        if (written == len - r->already_written) {
             // full packet written
-            s->allocated       = 0;
+            uint64_t held = now_usec() - s->time;
+            hist_record(&r->hold, held);
+            hist_record(&hold_total, held);
+            slot_put(&r->recv_buffer[r->deliver_seqno % r->window_size]);
             r->already_written = 0;
             ack_afterwards     = 1;
-            r->recv_seqno++;
+            r->deliver_seqno++;
         }
         else {
             // packet partially written
+            STAT_INC(r, outbuf_full);
             r->already_written += written;
             break;
         }
     }
 
-    if (ack_afterwards) {
+    if (ack_afterwards && !r->in_recvpkt) {
         send_ack(r);
     }
 
     if ( EOF_RECV(r->flags) ) {
         char buffer_empty = 1;
         for (size_t i = 0; i < r->window_size; i++) {
-            if ( r->recv_buffer[i].allocated ) {
+            if ( SLOT(r->recv_buffer[i])->allocated ) {
                 buffer_empty = 0;
                 break;
             }
@@ -348,43 +1828,109 @@ void rel_output (rel_t *r)
     }
 }
 
-void rel_timer ()
+// Sends what a full socket refused, in order, until it is full again
+void send_unsent(rel_t *r) {
+    r->send_full = 0;
+    for (size_t seqno = r->send_seqno; seqno < r->send_seqno + r->window_size && !r->send_full; seqno++) {
+        slice *s = SLOT(r->send_buffer[seqno % r->window_size]);
+        if (s->allocated && !s->tx_count) send_packet(r, seqno);
+    }
+}
+
+void rel_tick (rel_t *r)
 {
-    if (!EOF_READ(rel_list->flags)) { rel_read(rel_list); }
-    //send_ack(rel_list);
+    // fan-out: a group lives as long as its members
+    if (r->fan && r->fan->group == r) {
+        if (!r->fan->nmembers) rel_destroy(r);
+        return;
+    }
+    if (r->cut || r->lz_bad) {
+        rel_destroy(r);
+        return;
+    }
+    // until the peer's retransmissions, backed off, are surely over
+    if (r->dead) {
+        if (now_usec() - r->active >= IDLE_USEC + 8 * r->min_rto) rel_destroy(r);
+        return;
+    }
+
+    if (!EOF_READ(r->flags)) { rel_read(r); }
+    //send_ack(r);
+
+    // the ack policy held some back
+    if (r->unacked) send_ack(r);
+
+    // a lost ack could leave the sender waiting for credit forever
+    if (r->nstreams > 1 && !ALL_WRITTEN(r->flags) && now_usec() - r->credit_sent >= r->timeout) {
+        send_ack(r);
+    }
     
     /* Retransmit any packets that need to be retransmitted */
     slice* current_slice;
 
     int all_ackwoledged = 1;
-    slice *send_buffer = rel_list->send_buffer;
-    size_t window_size = rel_list->window_size;
-    size_t upper_bound = rel_list->send_seqno + window_size;
+    int timed_out = 0;
+    slice **send_buffer = r->send_buffer;
+    size_t window_size = r->window_size;
+    size_t upper_bound = r->send_seqno + window_size;
+    uint64_t now = now_usec();
 
     // go through window
-    for(size_t slice_no = rel_list->send_seqno; slice_no < upper_bound; slice_no++){
-        current_slice = &send_buffer[slice_no % window_size];
+    for(size_t slice_no = r->send_seqno; slice_no < upper_bound; slice_no++){
+        current_slice = SLOT(send_buffer[slice_no % window_size]);
 
-        // if packet is unackwnoledged
+        // if packet is unackwnoledged, (re)send it once it is due
         if(current_slice->allocated){
-            send_packet(rel_list, slice_no);
+            if (!current_slice->tx_count) {
+                send_packet(r, slice_no);
+            }
+            else if (now - current_slice->time >= r->timeout) {
+                r->fec_loss += (1 - r->fec_loss) / 64;
+                conn_path_feedback(r->c, current_slice->path, 0, 1);
+                send_packet(r, slice_no);
+                timed_out |= slice_no == r->send_seqno;
+            }
             all_ackwoledged = 0;
         }
     }
 
+    // the head of the window timed out before we had any rtt sample,
+    // so -t may be below the rtt and every packet goes out twice,
+    // which gives no samples (Karn): back off, up to 8 times -t, until
+    // one gets through
+    if (timed_out && !r->srtt) {
+        if (r->timeout < 8 * r->min_rto) r->timeout *= 2;
+    }
+
+    // don't leave the tail of a transfer unprotected
+    if (r->fec_count) fec_flush(r);
+
+    if (now - r->active >= IDLE_USEC) rel_idle(r);
+
     // Set correct flag if all packets where correctly recieved on the other side
-    if(EOF_READ(rel_list->flags) &&  all_ackwoledged){
-        SET_ALL_SENT_ACKNOWLEDGED(rel_list->flags);
+    if(EOF_READ(r->flags) &&  all_ackwoledged){
+        SET_ALL_SENT_ACKNOWLEDGED(r->flags);
     }
 
     // Call rel_destroy if session ended.
-    if (EOF_RECV(rel_list->flags) &&
-        EOF_READ(rel_list->flags) &&
-        ALL_SENT_ACKNOWLEDGED(rel_list->flags) &&
-        ALL_WRITTEN(rel_list->flags)
+    if (EOF_RECV(r->flags) &&
+        EOF_READ(r->flags) &&
+        ALL_SENT_ACKNOWLEDGED(r->flags) &&
+        ALL_WRITTEN(r->flags)
     ){
-        fprintf(stderr, "Destroy reliable connection now.\n");
-        rel_destroy(rel_list);
+        if (opt_debug) fprintf(stderr, "Destroy reliable connection now.\n");
+        rel_destroy(r);
+    }
+}
+
+void rel_timer ()
+{
+    rel_t *r, *next;
+
+    // rel_tick may destroy r
+    for (r = rel_list; r; r = next) {
+        next = r->next;
+        rel_tick(r);
     }
 }
 
@@ -394,3 +1940,35 @@ void save_pkt_to_file(packet_t *pkt){
     fclose(f);
     return;
 }
+
+void rel_dump_stats (rel_t *r, FILE *f)
+{
+    if (r == NULL) {
+        stats_print(f, "  ", &rel_totals);
+        hist_print(f, "  ", "rtt", &rtt_total);
+        hist_print(f, "  ", "hold", &hold_total);
+        fprintf(f, "  %-14s used=%lu peak=%lu free=%lu rels=%lu limit=%lu (slices of %lu bytes)\n",
+                "pool", pool.used, pool.peak, pool.nfree, pool.nrels,
+                pool.limit / SLICE_SIZE, SLICE_SIZE);
+        return;
+    }
+    stats_print(f, "  ", &r->stats);
+    hist_print(f, "  ", "rtt", &r->rtt);
+    hist_print(f, "  ", "hold", &r->hold);
+    fprintf(f, "  %-14s %lu\n", "send_seqno", r->send_seqno);
+    fprintf(f, "  %-14s %lu\n", "recv_seqno", r->recv_seqno);
+    fprintf(f, "  %-14s %lu\n", "deliver_seqno", r->deliver_seqno);
+    fprintf(f, "  %-14s %lu\n", "rwnd", r->rwnd);
+    fprintf(f, "  %-14s srtt=%lu rttvar=%lu rto=%lu (usec)\n", "rto", r->srtt, r->rttvar, r->timeout);
+    if (r->fan && r->fan->group == r) {
+        fanout *fo = r->fan;
+        fprintf(f, "  %-14s members=%d held=%lu/%lu base=%lu head=%lu%s\n", "fanout",
+                fo->nmembers, fo->head - fo->base, fo->size, fo->base, fo->head,
+                fo->drop ? " drop" : "");
+    }
+    for (int i = 0; r->streams && i < r->nstreams; i++) {
+        stream_state *st = &r->streams[i];
+        fprintf(f, "  stream %d next_sseq=%u credit=%u expect=%u\n",
+                i, st->next_sseq, st->credit, st->expect);
+    }
+}
@@ -0,0 +1,210 @@
+#ifdef __linux__
+# define _GNU_SOURCE
+#endif /* __linux__ */
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ring.h"
+
+#define RING_MAGIC 0x72696e67	/* "ring" */
+#define CACHE_LINE 64
+
+struct slot {
+    uint32_t len;
+    char data[];
+};
+
+struct ring {
+    uint32_t magic;
+    uint32_t nslots;
+    uint32_t stride;		/* bytes per slot, with its length */
+    char pad0[CACHE_LINE - 12];
+    uint32_t head;		/* next slot to fill, producer only */
+    char pad1[CACHE_LINE - 4];
+    uint32_t tail;		/* next slot to empty, consumer only */
+    char pad2[CACHE_LINE - 4];
+    char slots[];
+};
+
+static unsigned
+round_pow2 (unsigned n)
+{
+    unsigned p = 1;
+    while (p < n)
+        p <<= 1;
+    return p;
+}
+
+static size_t
+slot_stride (size_t slot_size)
+{
+    return (sizeof (struct slot) + slot_size + 7) & ~(size_t) 7;
+}
+
+static inline struct slot *
+slot_at (struct ring *r, uint32_t i)
+{
+    return (struct slot *) (r->slots + (size_t) (i & (r->nslots - 1)) * r->stride);
+}
+
+size_t
+ring_size (unsigned nslots, size_t slot_size)
+{
+    return sizeof (struct ring) + round_pow2 (nslots) * slot_stride (slot_size);
+}
+
+struct ring *
+ring_init (void *mem, unsigned nslots, size_t slot_size)
+{
+    struct ring *r = mem;
+    r->nslots = round_pow2 (nslots);
+    r->stride = slot_stride (slot_size);
+    r->head = r->tail = 0;
+    __atomic_store_n (&r->magic, RING_MAGIC, __ATOMIC_RELEASE);
+    return r;
+}
+
+void *
+ring_reserve (struct ring *r, size_t *cap)
+{
+    uint32_t tail = __atomic_load_n (&r->tail, __ATOMIC_ACQUIRE);
+
+    if (r->head - tail >= r->nslots)
+        return NULL;
+    *cap = r->stride - sizeof (struct slot);
+    return slot_at (r, r->head)->data;
+}
+
+int
+ring_commit (struct ring *r, size_t len)
+{
+    uint32_t head = r->head;
+
+    slot_at (r, head)->len = len;
+    __atomic_store_n (&r->head, head + 1, __ATOMIC_RELEASE);
+
+    /* Pairs with the fence in ring_peek: either the consumer sees the
+     * new head, or we see that it had taken everything before it and
+     * may be about to sleep. */
+    __atomic_thread_fence (__ATOMIC_SEQ_CST);
+    return __atomic_load_n (&r->tail, __ATOMIC_RELAXED) == head;
+}
+
+int
+ring_push (struct ring *r, const void *buf, size_t len)
+{
+    size_t cap;
+    void *data = ring_reserve (r, &cap);
+
+    if (!data || len > cap)
+        return -1;
+    memcpy (data, buf, len);
+    return ring_commit (r, len);
+}
+
+unsigned
+ring_free (struct ring *r)
+{
+    return r->nslots - (r->head - __atomic_load_n (&r->tail, __ATOMIC_ACQUIRE));
+}
+
+const void *
+ring_peek (struct ring *r, size_t *len)
+{
+    uint32_t tail = r->tail;
+    uint32_t head = __atomic_load_n (&r->head, __ATOMIC_ACQUIRE);
+    struct slot *s;
+
+    if (head == tail) {
+        __atomic_thread_fence (__ATOMIC_SEQ_CST);
+        head = __atomic_load_n (&r->head, __ATOMIC_ACQUIRE);
+        if (head == tail)
+            return NULL;
+    }
+    s = slot_at (r, tail);
+    /* The producer may be another process; don't trust it past the slot */
+    *len = s->len < r->stride - sizeof (struct slot)
+        ? s->len : r->stride - sizeof (struct slot);
+    return s->data;
+}
+
+void
+ring_release (struct ring *r)
+{
+    __atomic_store_n (&r->tail, r->tail + 1, __ATOMIC_RELEASE);
+}
+
+int
+ring_pop (struct ring *r, void *buf, size_t cap)
+{
+    size_t len;
+    const void *data = ring_peek (r, &len);
+
+    if (!data)
+        return -1;
+    if (len > cap)
+        len = cap;
+    memcpy (buf, data, len);
+    ring_release (r);
+    return len;
+}
+
+struct ring *
+ring_shm_create (unsigned nslots, size_t slot_size, int *fd)
+{
+#ifdef __linux__
+    size_t size = ring_size (nslots, slot_size);
+    void *mem;
+
+    if ((*fd = memfd_create ("ring", MFD_CLOEXEC)) < 0)
+        return NULL;
+    if (ftruncate (*fd, size) < 0
+            || (mem = mmap (NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED,
+                            *fd, 0)) == MAP_FAILED) {
+        int saved_errno = errno;
+        close (*fd);
+        errno = saved_errno;
+        return NULL;
+    }
+    return ring_init (mem, nslots, slot_size);
+#else /* !__linux__ */
+    errno = ENOSYS;
+    return NULL;
+#endif /* !__linux__ */
+}
+
+struct ring *
+ring_shm_map (int fd)
+{
+    struct stat sb;
+    struct ring *r;
+
+    if (fstat (fd, &sb) < 0)
+        return NULL;
+    if ((size_t) sb.st_size < sizeof (struct ring)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    r = mmap (NULL, sb.st_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if (r == MAP_FAILED)
+        return NULL;
+    if (__atomic_load_n (&r->magic, __ATOMIC_ACQUIRE) != RING_MAGIC
+            || !r->nslots || (r->nslots & (r->nslots - 1))
+            || r->stride <= sizeof (struct slot)
+            || sizeof (struct ring) + (size_t) r->nslots * r->stride
+               != (size_t) sb.st_size) {
+        munmap (r, sb.st_size);
+        errno = EINVAL;
+        return NULL;
+    }
+    return r;
+}
+
+void
+ring_shm_unmap (struct ring *r)
+{
+    munmap (r, sizeof (struct ring) + (size_t) r->nslots * r->stride);
+}
@@ -0,0 +1,61 @@
+#include <stddef.h>
+#include <stdint.h>
+
+/* -----------------------------------------------------------------------
+
+   Single-producer single-consumer ring of packets in shared memory.
+
+   The ring lives in one mapping: a header with the producer's head
+   and the consumer's tail on cache lines of their own, then the
+   slots.  Each side only writes its own index, so the two may run in
+   different processes or threads without locks.  Indexes run free
+   and are taken modulo the slot count, a power of 2.
+
+   Nothing here sleeps.  ring_push reports whether the ring was empty,
+   which is the only time the consumer may be waiting for a wakeup;
+   after finding the ring empty the consumer must wait for one before
+   it looks again.
+
+ */
+
+struct ring;
+
+/* Bytes of mapping a ring of nslots slots of slot_size bytes takes. */
+size_t ring_size (unsigned nslots, size_t slot_size);
+
+/* Make a ring in mem, which must be ring_size bytes and zeroed.
+   nslots is rounded up to a power of 2. */
+struct ring *ring_init (void *mem, unsigned nslots, size_t slot_size);
+
+/* Copy len bytes into the next slot.  Returns 1 if the ring was empty
+   before, so the consumer needs a wakeup, 0 if not, and -1 if the ring
+   is full or len is larger than a slot. */
+int ring_push (struct ring *r, const void *buf, size_t len);
+
+/* Copy the oldest entry into buf and free its slot.  Returns its
+   length, which is cut to cap, or -1 if the ring is empty. */
+int ring_pop (struct ring *r, void *buf, size_t cap);
+
+/* The same without the copies, for a producer and a consumer that
+   fill and use slots in place.  ring_reserve returns the next free
+   slot and sets *cap to its size, or returns NULL if the ring is full;
+   ring_commit then passes the first len bytes of it on and returns as
+   ring_push does.  ring_peek returns the oldest entry and sets *len,
+   or returns NULL if the ring is empty; ring_release frees it. */
+void *ring_reserve (struct ring *r, size_t *cap);
+int ring_commit (struct ring *r, size_t len);
+const void *ring_peek (struct ring *r, size_t *len);
+void ring_release (struct ring *r);
+
+/* Free slots, as the producer sees them. */
+unsigned ring_free (struct ring *r);
+
+/* A ring in a memfd another process can map: returns the ring and
+   sets *fd to the memfd, or returns NULL (and sets errno). */
+struct ring *ring_shm_create (unsigned nslots, size_t slot_size, int *fd);
+
+/* Map a ring made by ring_shm_create, given its memfd.  Returns NULL
+   if fd does not hold a ring. */
+struct ring *ring_shm_map (int fd);
+
+void ring_shm_unmap (struct ring *r);
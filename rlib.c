@@ -1,5 +1,8 @@
 /* rlib version 5 */
 
+#ifdef __linux__
+# define _GNU_SOURCE 1		/* sched_setaffinity */
+#endif /* __linux__ */
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
@@ -16,14 +19,42 @@
 #include <netinet/in.h>
 #include <poll.h>
 #include <signal.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#ifdef __linux__
+# include <sys/prctl.h>
+# include <sched.h>
+# include <linux/errqueue.h>
+# include <linux/net_tstamp.h>
+# include <sys/eventfd.h>
+#endif /* __linux__ */
 
 #include "rlib.h"
+#include "stats.h"
+#include "ring.h"
+#include "logq.h"
+#include "trace.h"
+#include "pipeline.h"
 
 char *progname;
 int opt_debug;
-int log_in = -1;
-int log_out = -1;
-
+int opt_reuseport;		/* bind UDP with SO_REUSEPORT (server workers) */
+int opt_busy_poll;		/* usec to spin before poll blocks, 0 for never */
+int opt_timestamps;		/* kernel send and receive timestamps (-T) */
+int opt_ring;			/* -u peers move packets over shared memory (-R) */
+
+/* Build flags for tools that link rlib.c:
+ *   RLIB_NO_MAIN    leave out main(), keep the socket connection layer
+ *   RLIB_UTIL_ONLY  only the utilities (xmalloc, cksum, addresses,
+ *                   sockets); the tool provides conn_* and now_usec */
+#if RLIB_UTIL_ONLY
+# undef RLIB_NO_MAIN
+# define RLIB_NO_MAIN 1
+#endif /* RLIB_UTIL_ONLY */
+
+#if !RLIB_UTIL_ONLY
 struct config_server {
     struct config_common c;
     int udp_socket;		/* Receive all UDP over this socket */
@@ -33,6 +64,21 @@ struct config_server {
 };
 
 static struct config_server *serverconf;
+static struct logq *log_in, *log_out;	/* -l */
+
+/* -x: the client's calls into reliable.c and the answers it got */
+static struct logq *trace;
+static uint64_t trace_bytes_out, trace_sends;
+static uint64_t trace_out_hash = TRACE_HASH_INIT;
+
+static void
+trace_rec (int type, const void *buf, size_t len)
+{
+    struct trace_rec h = { type, len, now_usec () };
+    logq_write (trace, &h, sizeof (h));
+    if (len)
+        logq_write (trace, buf, len);
+}
 
 static void conn_mkevents (void);
 static int debug_recv (int s, packet_t *buf, size_t len, int flags,
@@ -48,10 +94,38 @@ struct chunk {
     struct chunk *next;
     size_t size;
     size_t used;
+    uint64_t queued_at;		/* now_usec() when appended to outq */
     char buf[1];
 };
 typedef struct chunk chunk_t;
 
+#define MAX_PATHS 8
+#define PATH_RETRY_USEC 2000000	/* a down path is probed this often */
+
+/* Multipath: one of several socket pairs a connection stripes over */
+struct path {
+    int nfd;
+    int npoll;			/* offset into cevents array */
+    char down;			/* got ICMP port unreachable */
+    char probed;			/* sent an empty datagram while down */
+    uint64_t down_at;		/* now_usec() when last checked while down */
+    struct sockaddr_storage peer;
+
+    uint64_t srtt;		/* usec, 0 until the first sample */
+    double loss;			/* moving average of lost packets */
+    double credit;		/* smooth weighted round robin */
+    unsigned long sent, lost;
+};
+
+/* Multi-stream: an extra byte stream of a connection */
+struct stream {
+    int rfd, wfd;
+    int rpoll, wpoll;		/* offsets into cevents array */
+    char read_eof, write_eof, write_err, xoff;
+    chunk_t *outq;
+    chunk_t **outqtail;
+};
+
 struct conn {
     rel_t *rel;			/* Data from reliable */
 
@@ -63,7 +137,27 @@ struct conn {
     int wfd;			/* output file descriptor */
     int nfd;			/* network file descriptor */
     char server;			/* non-zero on server */
+    char unconnected;		/* -u client: send with sendto, the peer may
+				   not have bound its path yet */
     struct sockaddr_storage peer;	/* network peer */
+    struct path path[MAX_PATHS];	/* multipath: path[0] is nfd/peer */
+    int npaths;			/* > 1 when striping over several paths */
+    int lastpath;			/* path of the last conn_sendpkt */
+    struct stream *streams;	/* multi-stream: streams[s-1] is stream s */
+    int nstreams;			/* > 1 with extra streams */
+
+    char *map;			/* -i: input file mapped, or NULL */
+    size_t mapsize;
+    size_t mapoff;		/* where the input starts in it */
+    off_t outbase;		/* -o: where the output started, -1 before */
+
+    struct ring *rx_ring;	/* -R: the peer puts our packets here */
+    struct ring *tx_ring;	/* and we put its packets here, once offered */
+    int rx_mfd, rx_efd;		/* memfd and eventfd of rx_ring */
+    int tx_efd;			/* eventfd of tx_ring */
+    int ringpoll;			/* offset into cevents array */
+
+    struct pipeline *pl;		/* -p: input and output on threads */
 
     char read_eof;	        /* zero if haven't received EOF */
     char write_eof;		/* send EOF when output queue drained */
@@ -72,13 +166,34 @@ struct conn {
     char delete_me;		/* delete after draining */
     chunk_t *outq;		/* chunks not yet written */
     chunk_t **outqtail;
+    struct hist outq_delay;	/* time output spends in outq */
 
     struct conn *next;		/* Linked list of connections */
     struct conn **prev;
 };
 
 static conn_t *conn_list;
+static struct hist outq_delay_total;
+
+/* -T: kernel timestamps.  rx_stamp is the arrival of the packet being
+ * handled, in now_usec time, or 0 without one.  rx_delay is how long
+ * packets waited between the kernel and us, tx_delay how long sends
+ * took from conn_sendpkt until the kernel passed them to the device.
+ * The kernel numbers the sends on each socket; tx_rings remembers
+ * when recent ones were made, by socket. */
+static uint64_t rx_stamp;
+static struct hist rx_delay, tx_delay;
+
+#define TX_RING 256
+struct tx_ring {
+    uint32_t next;		/* kernel id of the next send */
+    uint64_t sent[TX_RING];	/* now_usec of sends, by id */
+};
+static struct tx_ring **tx_rings;
+static int ntx_rings;
 struct timespec last_timeout;
+static volatile sig_atomic_t dump_requested;
+#endif /* !RLIB_UTIL_ONLY */
 
 #if !DMALLOC
 void *
@@ -139,45 +254,399 @@ print_pkt (const packet_t *buf, const char *op, int n)
     errno = saved_errno;
 }
 
+#if !RLIB_UTIL_ONLY
+uint64_t
+now_usec (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* A CLOCK_REALTIME stamp from the kernel in now_usec time */
+static uint64_t
+stamp_usec (const struct timespec *stamp)
+{
+    struct timespec ts;
+    int64_t age;
+
+    clock_gettime (CLOCK_REALTIME, &ts);
+    age = (int64_t) (ts.tv_sec - stamp->tv_sec) * 1000000
+        + (ts.tv_nsec - stamp->tv_nsec) / 1000;
+    return now_usec () - (age > 0 ? age : 0);
+}
+
+uint64_t
+conn_rxtime (conn_t *c)
+{
+    (void) c;
+    return rx_stamp ? rx_stamp : now_usec ();
+}
+
+static struct tx_ring *
+tx_ring_of (int fd)
+{
+    if (fd >= ntx_rings) {
+        int n = fd + 16;
+        tx_rings = realloc (tx_rings, n * sizeof (*tx_rings));
+        assert (tx_rings);
+        memset (tx_rings + ntx_rings, 0, (n - ntx_rings) * sizeof (*tx_rings));
+        ntx_rings = n;
+    }
+    if (!tx_rings[fd]) {
+        tx_rings[fd] = xmalloc (sizeof (struct tx_ring));
+        memset (tx_rings[fd], 0, sizeof (struct tx_ring));
+    }
+    return tx_rings[fd];
+}
+
+/* Sends with a note of when, for the kernel's send timestamp */
+static int
+stamped_send (int fd, const packet_t *pkt, size_t len,
+              const struct sockaddr_storage *to)
+{
+    uint64_t now = opt_timestamps ? now_usec () : 0;
+    int n;
+
+    if (to)
+        n = sendto (fd, pkt, len, 0, (const struct sockaddr *) to, addrsize (to));
+    else
+        n = send (fd, pkt, len, 0);
+    if (n >= 0 && opt_timestamps) {
+        struct tx_ring *t = tx_ring_of (fd);
+        t->sent[t->next++ % TX_RING] = now;
+    }
+    return n;
+}
+
+/* -T: POLLERR also means send timestamps are waiting on the error
+ * queue.  Takes them, and returns whether the socket has an error
+ * besides. */
+static int
+sock_error (int fd)
+{
+#ifdef __linux__
+    char control[256];
+    struct msghdr msg;
+    struct cmsghdr *cm;
+    int err = 0;
+    socklen_t errlen = sizeof (err);
+
+    if (!opt_timestamps)
+        return 1;
+    for (;;) {
+        const struct scm_timestamping *ts = NULL;
+        const struct sock_extended_err *ee = NULL;
+
+        memset (&msg, 0, sizeof (msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof (control);
+        if (recvmsg (fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+            break;
+        for (cm = CMSG_FIRSTHDR (&msg); cm; cm = CMSG_NXTHDR (&msg, cm)) {
+            if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_TIMESTAMPING)
+                ts = (const struct scm_timestamping *) CMSG_DATA (cm);
+            else if ((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR)
+                     || (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+                ee = (const struct sock_extended_err *) CMSG_DATA (cm);
+        }
+        if (ts && ee && ee->ee_origin == SO_EE_ORIGIN_TIMESTAMPING
+                && fd < ntx_rings && tx_rings[fd]
+                && tx_rings[fd]->next - ee->ee_data <= TX_RING) {
+            uint64_t sent = tx_rings[fd]->sent[ee->ee_data % TX_RING];
+            uint64_t stamp = stamp_usec (&ts->ts[0]);
+            hist_record (&tx_delay, stamp > sent ? stamp - sent : 0);
+        }
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+        return 1;
+    if (getsockopt (fd, SOL_SOCKET, SO_ERROR, &err, &errlen) < 0)
+        return 1;
+    return err != 0;
+#else /* !__linux__ */
+    return 1;
+#endif /* !__linux__ */
+}
+
+static void
+conn_record_outq (conn_t *c, uint64_t usec)
+{
+    hist_record (&c->outq_delay, usec);
+    hist_record (&outq_delay_total, usec);
+}
+
+/* Weight of a path: packets per usec it delivers.  Paths without an
+ * rtt sample yet get the best weight so they get measured. */
+static double
+path_weight (const struct path *p, uint64_t best_rtt)
+{
+    uint64_t rtt = p->srtt ? p->srtt : best_rtt;
+    if (p->down)
+        return 0;
+    return (1.0 - p->loss) / (rtt ? rtt : 1);
+}
+
+/* Smooth weighted round robin: every path earns its weight in credit,
+ * the richest path sends and pays the sum of all weights.  Weights are
+ * relative to the best path, so credit stays in the same units while
+ * rtts change, and every live path keeps at least 1/20, so it keeps
+ * getting probed and can recover. */
+static int
+path_pick (conn_t *c)
+{
+    double w[MAX_PATHS], top = 0, total = 0;
+    uint64_t best_rtt = 0;
+    int i, pick = -1;
+
+    for (i = 0; i < c->npaths; i++)
+        if (c->path[i].srtt && (!best_rtt || c->path[i].srtt < best_rtt))
+            best_rtt = c->path[i].srtt;
+    for (i = 0; i < c->npaths; i++)
+        if ((w[i] = path_weight (&c->path[i], best_rtt)) > top)
+            top = w[i];
+    for (i = 0; i < c->npaths; i++) {
+        if (c->path[i].down)
+            continue;
+        w[i] = top > 0 ? w[i] / top : 1;
+        if (w[i] < 0.05)
+            w[i] = 0.05;
+        total += w[i];
+        c->path[i].credit += w[i];
+        if (pick < 0 || c->path[i].credit > c->path[pick].credit)
+            pick = i;
+    }
+    if (pick < 0)
+        return 0;
+    c->path[pick].credit -= total;
+    return pick;
+}
+
+int
+conn_lastpath (conn_t *c)
+{
+    return c->lastpath;
+}
+
+void
+conn_path_feedback (conn_t *c, int path, uint64_t rtt, int lost)
+{
+    struct path *p;
+
+    if (path < 0 || path >= c->npaths)
+        return;
+    p = &c->path[path];
+    p->loss = p->loss * 7 / 8 + (lost ? 1.0 / 8 : 0);
+    if (lost)
+        p->lost++;
+    else if (!p->srtt)
+        p->srtt = rtt;
+    else
+        p->srtt = (7 * p->srtt + rtt) / 8;
+}
+
+/* -R: each side makes the ring it receives on and offers it, memfd
+ * and eventfd, to its peer over the unix socket.  Until the peer's
+ * offer comes in, packets go over the socket as usual.  The offer is
+ * sent again every tick while we have none from the peer, and
+ * answered when the peer says it has none from us. */
+#define RING_SLOTS 1024
+
+struct ring_offer {
+    char magic[3];		/* "RNG", shorter than any packet */
+    char have_peer;		/* the sender already has our ring */
+};
+
+static void
+ring_offer (conn_t *c)
+{
+    struct ring_offer o = { { 'R', 'N', 'G' }, c->tx_ring != NULL };
+    union {
+        struct cmsghdr cm;
+        char buf[CMSG_SPACE (2 * sizeof (int))];
+    } control;
+    struct iovec iov = { &o, sizeof (o) };
+    struct msghdr msg;
+    int fds[2] = { c->rx_mfd, c->rx_efd };
+
+    memset (&msg, 0, sizeof (msg));
+    msg.msg_name = &c->peer;
+    msg.msg_namelen = addrsize (&c->peer);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof (control.buf);
+    control.cm.cmsg_level = SOL_SOCKET;
+    control.cm.cmsg_type = SCM_RIGHTS;
+    control.cm.cmsg_len = CMSG_LEN (sizeof (fds));
+    memcpy (CMSG_DATA (&control.cm), fds, sizeof (fds));
+    /* The peer may not be up yet, the next tick tries again */
+    sendmsg (c->nfd, &msg, 0);
+}
+
+/* Receives from the socket of a -R connection, taking ring offers */
+static int
+ring_sock_recv (conn_t *c, packet_t *pkt)
+{
+    union {
+        struct cmsghdr cm;
+        char buf[CMSG_SPACE (2 * sizeof (int))];
+    } control;
+    struct iovec iov = { pkt, sizeof (*pkt) };
+    struct msghdr msg;
+    struct cmsghdr *cm;
+    int fds[2] = { -1, -1 };
+    struct ring_offer o;
+    int n;
+    STAGE (STAGE_RECV);
+
+    rx_stamp = 0;
+    memset (&msg, 0, sizeof (msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof (control.buf);
+    if ((n = recvmsg (c->nfd, &msg, MSG_CMSG_CLOEXEC)) < 0)
+        return n;
+    for (cm = CMSG_FIRSTHDR (&msg); cm; cm = CMSG_NXTHDR (&msg, cm))
+        if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS
+                && cm->cmsg_len == CMSG_LEN (sizeof (fds)))
+            memcpy (fds, CMSG_DATA (cm), sizeof (fds));
+    memcpy (&o, pkt, sizeof (o));
+    if (fds[0] < 0 || n != sizeof (o) || memcmp (o.magic, "RNG", 3)) {
+        if (fds[0] >= 0) {
+            close (fds[0]);
+            close (fds[1]);
+        }
+        if (opt_debug)
+            print_pkt (pkt, "recv", n);
+        return n;
+    }
+
+    if (!c->tx_ring && (c->tx_ring = ring_shm_map (fds[0])))
+        c->tx_efd = fds[1];
+    else {
+        if (!c->tx_ring)
+            perror ("ring offer");
+        close (fds[1]);
+    }
+    close (fds[0]);
+    if (!o.have_peer)
+        ring_offer (c);
+    errno = EAGAIN;
+    return -1;
+}
+
+/* Takes the packets the peer put on our ring */
+static void
+ring_drain (conn_t *c)
+{
+    uint64_t count;
+    packet_t pkt;
+    int i, len;
+
+    if (read (c->rx_efd, &count, sizeof (count)) < 0 && errno != EAGAIN)
+        perror ("eventfd");
+    for (i = 0; i < 64 && !c->delete_me; i++) {
+        {
+            STAGE (STAGE_RECV);
+            len = ring_pop (c->rx_ring, &pkt, sizeof (pkt));
+        }
+        if (len < 0)
+            return;
+        rx_stamp = 0;
+        if (opt_debug)
+            print_pkt (&pkt, "recv", len);
+        if (trace)
+            trace_rec (TRACE_PKT, &pkt, len);
+        rel_recvpkt (c->rel, &pkt, len);
+    }
+    /* Give the rest of the loop a turn; wake up again for what's left */
+    count = 1;
+    if (!c->delete_me && write (c->rx_efd, &count, sizeof (count)) < 0)
+        perror ("eventfd");
+}
+
 int
 conn_sendpkt (conn_t *c, const packet_t *pkt, size_t len)
 {
     int n;
+    STAGE (STAGE_SENDTO);
     assert (!c->delete_me);
-    if (c->server)
-        n = sendto (c->nfd, pkt, len, 0,
-                    (const struct sockaddr *) &c->peer, addrsize (&c->peer));
+    trace_sends++;
+    if (c->tx_ring) {
+        int empty = ring_push (c->tx_ring, pkt, len);
+        uint64_t one = 1;
+        if (empty < 0) {
+            errno = EAGAIN;
+            n = -1;
+        }
+        else {
+            n = len;
+            /* The peer only waits for the packet that ends an empty ring */
+            if (empty && write (c->tx_efd, &one, sizeof (one)) < 0)
+                perror ("eventfd");
+        }
+    }
+    else if (c->npaths > 1) {
+        struct path *p = &c->path[c->lastpath = path_pick (c)];
+        p->sent++;
+        n = stamped_send (p->nfd, pkt, len, NULL);
+    }
+    else if (c->server || c->unconnected)
+        n = stamped_send (c->nfd, pkt, len, &c->peer);
     else
-        n = send (c->nfd, pkt, len, 0);
+        n = stamped_send (c->nfd, pkt, len, NULL);
     if (opt_debug)
         print_pkt (pkt, "send", n);
     return n;
 }
 
-size_t
-conn_bufspace (conn_t *c)
+static size_t
+outq_space (const chunk_t *ch)
 {
-    chunk_t *ch;
     size_t used = 0;
     const size_t bufsize = 8192;
 
-
-    for (ch = c->outq; ch; ch = ch->next)
+    for (; ch; ch = ch->next)
         used += (ch->size - ch->used);
     return used > bufsize ? 0 : bufsize - used;
 }
 
+static chunk_t *
+chunk_new (const char *buf, size_t n)
+{
+    chunk_t *ch = xmalloc (offsetof (chunk_t, buf[n]));
+    ch->next = NULL;
+    ch->size = n;
+    ch->used = 0;
+    ch->queued_at = now_usec ();
+    memcpy (ch->buf, buf, n);
+    return ch;
+}
+
+size_t
+conn_bufspace (conn_t *c)
+{
+    uint64_t space = c->pl ? pipeline_space (c->pl) : outq_space (c->outq);
+    if (trace)
+        trace_rec (TRACE_BUFSPACE, &space, sizeof (space));
+    return space;
+}
+
 int
 conn_output (conn_t *c, const void *_buf, size_t _n)
 {
     const char *buf = _buf;
     int n = _n;
+    STAGE (STAGE_WRITE);
 
     assert (!c->delete_me && !c->write_eof);
 
     if (n == 0) {
         c->write_eof = 1;
-        if (!c->outq)
+        if (c->pl)
+            pipeline_close_output (c->pl);
+        else if (!c->outq)
             shutdown (c->wfd, SHUT_WR);
         return 0;
     }
@@ -189,11 +658,19 @@ conn_output (conn_t *c, const void *_buf, size_t _n)
         return -1;
     }
 
-    if (!conn_bufspace (c))
+    if (c->pl ? !pipeline_space (c->pl) : !outq_space (c->outq))
         return 0;
-
-    if (log_out >= 0)
-        write (log_out, buf, n);
+    if (c->pl)
+        n = pipeline_write (c->pl, buf, n);
+
+    if (log_out)
+        logq_write (log_out, buf, n);
+    if (trace) {
+        trace_out_hash = trace_hash (trace_out_hash, buf, n);
+        trace_bytes_out += n;
+    }
+    if (c->pl)
+        return n;
 
     if (!c->outq) {
         int r = write (c->wfd, buf, n);
@@ -211,14 +688,12 @@ conn_output (conn_t *c, const void *_buf, size_t _n)
     }
 
     if (n > 0) {
-        chunk_t *ch = xmalloc (offsetof (chunk_t, buf[n]));
-        ch->next = NULL;
-        ch->size = n;
-        ch->used = 0;
-        memcpy (ch->buf, buf, n);
+        chunk_t *ch = chunk_new (buf, n);
         *c->outqtail = ch;
         c->outqtail = &ch->next;
     }
+    else
+        conn_record_outq (c, 0);
 
     if (c->wpoll && c->outq)
     cevents[c->wpoll].events |= POLLOUT;
@@ -231,27 +706,235 @@ conn_input (conn_t *c, void *buf, size_t n)
     int r;
     assert (!c->delete_me);
 
-    if (c->read_eof)
+    if (c->read_eof) {
+        if (trace)
+            trace_rec (TRACE_INPUT_EOF, NULL, 0);
         return -1;
-    r = read (c->rfd, buf, n);
+    }
+    r = c->pl ? pipeline_read (c->pl, buf, n) : read (c->rfd, buf, n);
     if (r == 0 || (r < 0 && errno != EAGAIN)) {
         if (r == 0)
             errno = EIO;
         r = -1;
         c->read_eof = 1;
+        if (trace)
+            trace_rec (TRACE_INPUT_EOF, NULL, 0);
+        /* Input may be readable again if we got here from anything
+         * but its own poll event; stop polling it */
+        cevents_generation++;
         return r;
     }
     if (r < 0 && errno == EAGAIN)
         r = 0;
 
-    if (r > 0 && log_in >= 0)
-        write (log_in, buf, r);
+    if (r > 0 && log_in)
+        logq_write (log_in, buf, r);
+    if (trace)
+        trace_rec (TRACE_INPUT, buf, r);
 
     c->xoff = 0;
     cevents[c->rpoll].events |= POLLIN;
     return r;
 }
 
+int
+conn_output_at (conn_t *c, const void *_buf, size_t len, uint64_t off)
+{
+    const char *buf = _buf;
+    size_t done = 0;
+    STAGE (STAGE_WRITE);
+
+    assert (!c->delete_me && !c->write_eof);
+    if (c->write_err)
+        return -1;
+    if (c->outbase < 0) {
+        /* Linux pwrite ignores the offset on an O_APPEND descriptor. */
+        int fl = fcntl (c->wfd, F_GETFL);
+        if (fl < 0 || (fl & O_APPEND))
+            return -1;
+        if ((c->outbase = lseek (c->wfd, 0, SEEK_CUR)) < 0)
+            return -1;
+    }
+    while (done < len) {
+        ssize_t r = pwrite (c->wfd, buf + done, len - done, c->outbase + off + done);
+        if (r < 0) {
+            perror ("pwrite");
+            return -1;
+        }
+        done += r;
+    }
+    return len;
+}
+
+const char *
+conn_input_map (conn_t *c, size_t *len)
+{
+    struct stat st;
+    off_t pos;
+
+    if (!c->map) {
+        if (fstat (c->rfd, &st) < 0 || !S_ISREG (st.st_mode)
+                || (pos = lseek (c->rfd, 0, SEEK_CUR)) < 0 || pos >= st.st_size)
+            return NULL;
+        /* The whole file, a mapping has to start on a page */
+        c->map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, c->rfd, 0);
+        if (c->map == MAP_FAILED) {
+            perror ("mmap");
+            c->map = NULL;
+            return NULL;
+        }
+        madvise (c->map, st.st_size, MADV_SEQUENTIAL);
+        c->mapsize = st.st_size;
+        c->mapoff = pos;
+        /* nothing to poll for any more */
+        c->read_eof = 1;
+        cevents_generation++;
+        if (log_in)
+            logq_write (log_in, c->map + pos, st.st_size - pos);
+    }
+    *len = c->mapsize - c->mapoff;
+    return c->map + c->mapoff;
+}
+
+int
+conn_nstreams (conn_t *c)
+{
+    return c->nstreams > 1 ? c->nstreams : 1;
+}
+
+size_t
+conn_stream_bufspace (conn_t *c, int s)
+{
+    if (s == 0)
+        return conn_bufspace (c);
+    return outq_space (c->streams[s-1].outq);
+}
+
+/* End of output on an extra stream.  These are usually pipes or
+ * files, which cannot shut down just one direction. */
+static void
+stream_close_wfd (struct stream *st)
+{
+    st->write_err = 1;
+    if (st->wfd == st->rfd)
+        shutdown (st->wfd, SHUT_WR);
+    else {
+        close (st->wfd);
+        st->wfd = -1;
+    }
+    cevents_generation++;
+}
+
+int
+conn_stream_output (conn_t *c, int s, const void *_buf, size_t _n)
+{
+    struct stream *st;
+    const char *buf = _buf;
+    int n = _n;
+
+    if (s == 0)
+        return conn_output (c, _buf, _n);
+    st = &c->streams[s-1];
+    assert (!c->delete_me && !st->write_eof);
+
+    if (n == 0) {
+        st->write_eof = 1;
+        if (!st->outq && !st->write_err)
+            stream_close_wfd (st);
+        return 0;
+    }
+    if (st->write_err)
+        return -1;
+    if (!outq_space (st->outq))
+        return 0;
+
+    if (!st->outq) {
+        int r = write (st->wfd, buf, n);
+        if (r < 0) {
+            if (errno != EAGAIN) {
+                perror ("write");
+                st->write_err = 1;
+                return -1;
+            }
+        }
+        else {
+            buf += r;
+            n -= r;
+        }
+    }
+    if (n > 0) {
+        chunk_t *ch = chunk_new (buf, n);
+        *st->outqtail = ch;
+        st->outqtail = &ch->next;
+        if (st->wpoll)
+            cevents[st->wpoll].events |= POLLOUT;
+    }
+    return _n;
+}
+
+int
+conn_stream_input (conn_t *c, int s, void *buf, size_t n)
+{
+    struct stream *st;
+    int r;
+
+    if (s == 0)
+        return conn_input (c, buf, n);
+    st = &c->streams[s-1];
+    if (st->read_eof)
+        return -1;
+    r = read (st->rfd, buf, n);
+    if (r == 0 || (r < 0 && errno != EAGAIN)) {
+        st->read_eof = 1;
+        cevents_generation++;
+        return -1;
+    }
+    if (r < 0)
+        r = 0;
+    st->xoff = 0;
+    if (st->rpoll)
+        cevents[st->rpoll].events |= POLLIN;
+    return r;
+}
+
+/* Returns non-zero if it wrote anything */
+static int
+stream_drain (struct stream *st)
+{
+    chunk_t *ch;
+    int didsome = 0;
+
+    if (st->wpoll)
+        cevents[st->wpoll].events &= ~POLLOUT;
+    if (st->write_err)
+        return 0;
+
+    while ((ch = st->outq)) {
+        int n = write (st->wfd, ch->buf + ch->used, ch->size - ch->used);
+        if (n < 0) {
+            if (errno != EAGAIN)
+                st->write_err = 1;
+            else if (st->wpoll)
+                cevents[st->wpoll].events |= POLLOUT;
+            break;
+        }
+        didsome = 1;
+        ch->used += n;
+        if (ch->used < ch->size) {
+            if (st->wpoll)
+                cevents[st->wpoll].events |= POLLOUT;
+            break;
+        }
+        st->outq = ch->next;
+        if (!st->outq)
+            st->outqtail = &st->outq;
+        free (ch);
+    }
+    if (st->write_eof && !st->write_err && !st->outq)
+        stream_close_wfd (st);
+    return didsome;
+}
+
 static conn_t *
 conn_alloc (void)
 {
@@ -260,6 +943,7 @@ conn_alloc (void)
     c->prev = &conn_list;
     c->next = conn_list;
     c->outqtail = &c->outq;
+    c->outbase = -1;
     if (conn_list)
         conn_list->prev = &c->next;
     conn_list = c;
@@ -317,11 +1001,35 @@ conn_free (conn_t *c)
         c->next->prev = c->prev;
     *c->prev = c->next;
 
+    if (c->map)
+        munmap (c->map, c->mapsize);
+    if (c->rx_ring) {
+        ring_shm_unmap (c->rx_ring);
+        close (c->rx_mfd);
+        close (c->rx_efd);
+    }
+    if (c->tx_ring) {
+        ring_shm_unmap (c->tx_ring);
+        close (c->tx_efd);
+    }
     close (c->rfd);
     if (c->wfd != c->rfd)
         close (c->wfd);
     if (!c->server)
         close (c->nfd);
+    for (int i = 1; i < c->npaths; i++)
+        close (c->path[i].nfd);
+    for (int i = 1; i < c->nstreams; i++) {
+        struct stream *st = &c->streams[i-1];
+        for (ch = st->outq; ch; ch = nch) {
+            nch = ch->next;
+            free (ch);
+        }
+        close (st->rfd);
+        if (st->wfd >= 0 && st->wfd != st->rfd)
+            close (st->wfd);
+    }
+    free (c->streams);
 
     cevents_generation++;
 
@@ -341,19 +1049,33 @@ conn_drain (conn_t *c)
 {
     chunk_t *ch;
     int didsome = 0;
+    STAGE (STAGE_WRITE);
+
+    for (int i = 1; i < c->nstreams; i++)
+        didsome |= stream_drain (&c->streams[i-1]);
+
+    /* -p: the writer thread made room for output, or is done */
+    if (c->pl) {
+        if (pipeline_wakeup (c->pl)) {
+            c->write_err = 1;
+            cevents_generation++;
+        }
+        didsome = 1;
+    }
 
     if (c->wpoll)
         cevents[c->wpoll].events &= ~POLLOUT;
 
-    if (c->write_err)
-        return;
-
-    while ((ch = c->outq)) {
+    while (!c->write_err && (ch = c->outq)) {
         int n = write (c->wfd, ch->buf + ch->used,
         ch->size - ch->used);
         if (n < 0) {
             if (errno != EAGAIN)
                 c->write_err = 1;
+            else if (c->wpoll)
+                /* A pipe reports POLLOUT before it has room for an
+                 * atomic write, so wait for the next one */
+                cevents[c->wpoll].events |= POLLOUT;
             break;
         }
         didsome = 1;
@@ -366,14 +1088,18 @@ conn_drain (conn_t *c)
         c->outq = ch->next;
         if (!c->outq)
             c->outqtail = &c->outq;
+        conn_record_outq (c, now_usec () - ch->queued_at);
         free (ch);
     }
-    if (c->write_eof && !c->write_err && !c->outq) {
+    if (c->write_eof && !c->write_err && !c->outq && !c->pl) {
         c->write_err = 1;
         shutdown (c->wfd, SHUT_WR);
     }
-    if (didsome && !c->delete_me)
+    if (didsome && !c->delete_me) {
+        if (trace)
+            trace_rec (TRACE_OUTPUT, NULL, 0);
         rel_output (c->rel);
+    }
 }
 
 static void
@@ -396,7 +1122,7 @@ conn_mkevents (void)
             c->rpoll = n++;
             if (c->write_err)
                 c->wpoll = 0;
-            else if (c->wfd == c->rfd)
+            else if (c->wfd == c->rfd && !c->pl)
                 c->wpoll = c->rpoll;
             else
                 c->wpoll = n++;
@@ -405,6 +1131,14 @@ conn_mkevents (void)
             c->npoll = 0;
         else
             c->npoll = n++;
+        c->ringpoll = c->rx_ring ? n++ : 0;
+        for (int i = 1; i < c->npaths; i++)
+            c->path[i].npoll = c->path[i].down ? 0 : n++;
+        for (int i = 1; i < c->nstreams; i++) {
+            struct stream *st = &c->streams[i-1];
+            st->rpoll = st->read_eof ? 0 : n++;
+            st->wpoll = st->write_err ? 0 : n++;
+        }
     }
 
     e = xmalloc (n * sizeof (*e));
@@ -417,11 +1151,15 @@ conn_mkevents (void)
 
     for (c = conn_list; c; c = c->next) {
         if (c->rpoll) {
-            e[c->rpoll].fd = c->rfd;
+            e[c->rpoll].fd = c->pl ? pipeline_input_fd (c->pl) : c->rfd;
             if (!c->xoff)
                 e[c->rpoll].events |= POLLIN;
         }
-        if (c->wpoll) {
+        if (c->wpoll && c->pl) {
+            e[c->wpoll].fd = pipeline_output_fd (c->pl);
+            e[c->wpoll].events |= POLLIN;
+        }
+        else if (c->wpoll) {
             e[c->wpoll].fd = c->wfd;
             if (c->outq)
                 e[c->wpoll].events |= POLLOUT;
@@ -430,6 +1168,28 @@ conn_mkevents (void)
             e[c->npoll].fd = c->nfd;
             e[c->npoll].events |= POLLIN;
         }
+        if (c->ringpoll) {
+            e[c->ringpoll].fd = c->rx_efd;
+            e[c->ringpoll].events |= POLLIN;
+        }
+        for (int i = 1; i < c->npaths; i++)
+            if (c->path[i].npoll) {
+                e[c->path[i].npoll].fd = c->path[i].nfd;
+                e[c->path[i].npoll].events |= POLLIN;
+            }
+        for (int i = 1; i < c->nstreams; i++) {
+            struct stream *st = &c->streams[i-1];
+            if (st->rpoll) {
+                e[st->rpoll].fd = st->rfd;
+                if (!st->xoff)
+                    e[st->rpoll].events |= POLLIN;
+            }
+            if (st->wpoll) {
+                e[st->wpoll].fd = st->wfd;
+                if (st->outq)
+                    e[st->wpoll].events |= POLLOUT;
+            }
+        }
     }
 
     r = xmalloc (n * sizeof (*r));
@@ -441,8 +1201,19 @@ conn_mkevents (void)
             r[c->rpoll] = c;
         if (c->npoll > 0)
             r[c->npoll] = c;
+        if (c->ringpoll > 0)
+            r[c->ringpoll] = c;
         if (c->wpoll > 0)
             w[c->wpoll] = c;
+        for (int i = 1; i < c->npaths; i++)
+            if (c->path[i].npoll > 0)
+                r[c->path[i].npoll] = c;
+        for (int i = 1; i < c->nstreams; i++) {
+            if (c->streams[i-1].rpoll > 0)
+                r[c->streams[i-1].rpoll] = c;
+            if (c->streams[i-1].wpoll > 0)
+                w[c->streams[i-1].wpoll] = c;
+        }
     }
 
     free (cevents);
@@ -470,11 +1241,167 @@ need_timer_in (const struct timespec *last, long timer)
     return timer - to;
 }
 
+/* Busy polling: how often spinning found an event, and how often it
+ * gave up and blocked */
+static uint64_t busy_hits, busy_misses;
+
+/* poll, but with -B spin on a non-blocking poll for up to
+ * opt_busy_poll usec first, to save the wakeup when the next event
+ * comes soon */
+static int
+conn_wait (struct pollfd *fds, int n, long timeout)
+{
+    struct timespec start, ts;
+    long spun;
+    int ready;
+
+    if (!opt_busy_poll || !timeout)
+        return poll (fds, n, timeout);
+
+    clock_gettime (CLOCK_MONOTONIC, &start);
+    do {
+        if ((ready = poll (fds, n, 0)) != 0) {
+            busy_hits++;
+            return ready;
+        }
+        clock_gettime (CLOCK_MONOTONIC, &ts);
+        spun = (ts.tv_sec - start.tv_sec) * 1000000
+            + (ts.tv_nsec - start.tv_nsec) / 1000;
+    } while (spun < opt_busy_poll && spun < timeout * 1000);
+
+    busy_misses++;
+    timeout -= spun / 1000;
+    return poll (fds, n, timeout > 0 ? timeout : 0);
+}
+
+static void
+conn_dump_stats (FILE *f)
+{
+    conn_t *c;
+    chunk_t *ch;
+
+    for (c = conn_list; c; c = c->next) {
+        size_t queued = 0;
+        char addr[NI_MAXHOST] = "unknown";
+        char port[NI_MAXSERV] = "unknown";
+        getnameinfo ((const struct sockaddr *) &c->peer, sizeof (c->peer),
+                     addr, sizeof (addr), port, sizeof (port),
+                     NI_DGRAM | NI_NUMERICHOST | NI_NUMERICSERV);
+        fprintf (f, "%s: [peer %s:%s]\n", progname, addr, port);
+        if (!c->delete_me)
+            rel_dump_stats (c->rel, f);
+        for (ch = c->outq; ch; ch = ch->next)
+            queued += ch->size - ch->used;
+        fprintf (f, "  %-14s %lu\n", "outq_bytes", (unsigned long) queued);
+        if (c->pl)
+            pipeline_dump (c->pl, f);
+        for (int i = 0; i < c->npaths; i++) {
+            const struct path *p = &c->path[i];
+            getnameinfo ((const struct sockaddr *) &p->peer, sizeof (p->peer),
+                         addr, sizeof (addr), port, sizeof (port),
+                         NI_DGRAM | NI_NUMERICHOST | NI_NUMERICSERV);
+            fprintf (f, "  path %d %s:%s%s srtt=%lu loss=%.3f sent=%lu lost=%lu\n",
+                     i, addr, port, p->down ? " down" : "",
+                     (unsigned long) p->srtt, p->loss, p->sent, p->lost);
+        }
+        hist_print (f, "  ", "outq_delay", &c->outq_delay);
+    }
+    fprintf (f, "%s: [total]\n", progname);
+    rel_dump_stats (NULL, f);
+    hist_print (f, "  ", "outq_delay", &outq_delay_total);
+    if (opt_timestamps) {
+        hist_print (f, "  ", "rx_delay", &rx_delay);
+        hist_print (f, "  ", "tx_delay", &tx_delay);
+    }
+    if (opt_busy_poll)
+        fprintf (f, "  %-14s hits=%lu misses=%lu\n", "busy_poll",
+                 (unsigned long) busy_hits, (unsigned long) busy_misses);
+#if RLIB_STAGES
+    stages_print (f, "  ");
+#endif /* RLIB_STAGES */
+    if (log_in)
+        logq_dump (log_in, f, "log_in");
+    if (log_out)
+        logq_dump (log_out, f, "log_out");
+    fflush (f);
+}
+
+/* Multipath: index of the path using fd, or -1 */
+static int
+conn_path_of (conn_t *c, int fd)
+{
+    for (int i = 0; i < c->npaths; i++)
+        if (c->path[i].nfd == fd)
+            return i;
+    return -1;
+}
+
+/* Multi-stream: the extra stream reading from fd, or NULL */
+static struct stream *
+conn_stream_of (conn_t *c, int fd)
+{
+    for (int i = 1; i < c->nstreams; i++)
+        if (c->streams[i-1].rpoll && c->streams[i-1].rfd == fd)
+            return &c->streams[i-1];
+    return NULL;
+}
+
+/* Take the error a path's socket is holding; returns whether it had one */
+static int
+path_error (int fd)
+{
+    int err = 0;
+    socklen_t errlen = sizeof (err);
+    return getsockopt (fd, SOL_SOCKET, SO_ERROR, &err, &errlen) == 0 && err;
+}
+
+/* A down path is not polled and carries no data.  Every
+ * PATH_RETRY_USEC it gets an empty datagram, which the peer drops; if
+ * no ICMP error for it is waiting by the next round, the path is back. */
+static void
+paths_retry (conn_t *c)
+{
+    uint64_t now = now_usec ();
+
+    for (int i = 0; i < c->npaths; i++) {
+        struct path *p = &c->path[i];
+        if (!p->down || now - p->down_at < PATH_RETRY_USEC)
+            continue;
+        p->down_at = now;
+        if (p->probed && !path_error (p->nfd)) {
+            fprintf (stderr, "[path %d: peer is back]\n", i);
+            p->down = 0;
+            cevents_generation++;
+            continue;
+        }
+        p->probed = send (p->nfd, "", 0, 0) == 0;
+    }
+}
+
+static int
+conn_paths_down (conn_t *c)
+{
+    for (int i = 0; i < c->npaths; i++)
+        if (!c->path[i].down)
+            return 0;
+    return 1;
+}
+
+static int
+conn_streams_drained (conn_t *c)
+{
+    for (int i = 1; i < c->nstreams; i++)
+        if (!c->streams[i-1].write_err && c->streams[i-1].outq)
+            return 0;
+    return 1;
+}
+
 void
 conn_poll (const struct config_common *cc)
 {
-    int i;
+    int i, p;
     conn_t *c, *nc;
+    struct stream *st;
     static int last_cg;
 
     if (last_cg != cevents_generation) {
@@ -483,18 +1410,65 @@ conn_poll (const struct config_common *cc)
     }
 
     if (cevents[0].fd >= 0)
-        poll (cevents, ncevents, need_timer_in (&last_timeout, cc->timer));
+        conn_wait (cevents, ncevents, need_timer_in (&last_timeout, cc->timer));
     else
-        poll (cevents+1, ncevents-1, need_timer_in (&last_timeout, cc->timer));
+        conn_wait (cevents+1, ncevents-1, need_timer_in (&last_timeout, cc->timer));
+
+    if (opt_timestamps)
+        for (i = 0; i < ncevents; i++)
+            if ((cevents[i].revents & POLLERR) && !sock_error (cevents[i].fd))
+                cevents[i].revents &= ~POLLERR;
+
+    if (dump_requested) {
+        dump_requested = 0;
+        conn_dump_stats (stderr);
+    }
+
+    /* Server: everything from clients arrives on one UDP socket */
+    if (cevents[0].fd >= 0 && (cevents[0].revents & POLLIN)) {
+        packet_t pkt;
+        struct sockaddr_storage from;
+        int len;
+
+        for (i = 0; i < 64; i++) {
+            len = debug_recv (cevents[0].fd, &pkt, sizeof (pkt), 0, &from);
+            if (len < 0)
+                break;
+            rel_demux (cc, &from, &pkt, len);
+        }
+    }
+    cevents[0].revents = 0;
 
     for (i = 1; i < ncevents; i++) {
         if (cevents[i].revents & (POLLIN|POLLERR|POLLHUP)) {
             if ((c = evreaders[i]) && !c->delete_me) {
-                if (cevents[i].fd == c->rfd) {
+                if (i == c->rpoll) {
                     c->xoff = 1;
                     cevents[i].events &= ~POLLIN;
+                    if (trace)
+                        trace_rec (TRACE_READ, NULL, 0);
+                    rel_read (c->rel);
+                }
+                else if ((st = conn_stream_of (c, cevents[i].fd))) {
+                    st->xoff = 1;
+                    cevents[i].events &= ~POLLIN;
                     rel_read (c->rel);
                 }
+                else if ((p = conn_path_of (c, cevents[i].fd)) >= 0
+                         && (cevents[i].revents & (POLLERR|POLLHUP))) {
+                    /* One of several paths died, keep the others */
+                    fprintf (stderr, "[path %d: received ICMP port unreachable]\n", p);
+                    c->path[p].down = 1;
+                    c->path[p].probed = 0;
+                    c->path[p].down_at = now_usec ();
+                    path_error (c->path[p].nfd);
+                    cevents_generation++;
+                    if (conn_paths_down (c)) {
+                        if (cc->single_connection)
+                            exit (1);
+                        rel_destroy (c->rel);
+                    }
+                }
                 else if (cevents[i].fd == c->nfd
                          && (cevents[i].revents & (POLLERR|POLLHUP))) {
                     char addr[NI_MAXHOST] = "unknown";
@@ -508,23 +1482,33 @@ conn_poll (const struct config_common *cc)
                     exit (1);
                     rel_destroy (c->rel);
                 }
-                else if (cevents[i].fd == c->nfd && !c->server) {
+                else if (c->rx_ring && cevents[i].fd == c->rx_efd)
+                    ring_drain (c);
+                else if ((cevents[i].fd == c->nfd && !c->server)
+                         || conn_path_of (c, cevents[i].fd) >= 0) {
                     packet_t pkt;
-                    int len = debug_recv (c->nfd, &pkt, sizeof (pkt), 0, NULL);
+                    int len = c->rx_ring ? ring_sock_recv (c, &pkt)
+                        : debug_recv (cevents[i].fd, &pkt, sizeof (pkt), 0, NULL);
                     if (len < 0) {
                         if (errno != EAGAIN)
                             perror ("recv");
                     }
+                    else if (len == 0 && c->npaths > 1)
+                        ;		/* the peer probing a down path */
                     else {
+                        if (trace)
+                            trace_rec (TRACE_PKT, &pkt, len);
                         rel_recvpkt (c->rel, &pkt, len);
                         memset (&pkt, 0xc9, len); /* for debugging */
                     }
                 }
             }
         }
-        if ((cevents[i].revents & (POLLOUT|POLLHUP|POLLERR))
-                && evwriters[i])
-            conn_drain (evwriters[i]);
+        /* -p: wakeups from the writer thread come as POLLIN */
+        if ((c = evwriters[i])
+                && (cevents[i].revents
+                    & (POLLOUT|POLLHUP|POLLERR|(c->pl ? POLLIN : 0))))
+            conn_drain (c);
         if (cevents[i].revents & (POLLHUP|POLLERR)) {
 #if 0
             fprintf (stderr, "%5d Error on fd %d (0x%x)\n",
@@ -540,17 +1524,31 @@ conn_poll (const struct config_common *cc)
     }
 
     if (need_timer_in (&last_timeout, cc->timer) == 0) {
+        if (trace)
+            trace_rec (TRACE_TIMER, NULL, 0);
         rel_timer ();
+        for (c = conn_list; c; c = c->next) {
+            if (c->rx_ring && !c->tx_ring && !c->delete_me)
+                ring_offer (c);
+            if (c->npaths > 1 && !c->delete_me)
+                paths_retry (c);
+        }
         clock_gettime (CLOCK_MONOTONIC, &last_timeout);
     }
 
     for (c = conn_list; c; c = nc) {
         nc = c->next;
-        if (c->delete_me && (c->write_err || !c->outq))
+        /* -p: output of this round goes to the writer now */
+        if (c->pl)
+            pipeline_flush (c->pl);
+        if (c->delete_me && (c->write_err || (!c->outq && !c->pl))
+                && conn_streams_drained (c))
             conn_free (c);
     }
 }
 
+#endif /* !RLIB_UTIL_ONLY */
+
 uint16_t
 cksum (const void *_data, int len)
 {
@@ -730,6 +1728,7 @@ listen_on (int dgram, struct sockaddr_storage *ss)
 {
     int type = dgram ? SOCK_DGRAM : SOCK_STREAM;
     int s = socket (ss->ss_family, type, 0);
+    int udp = dgram && ss->ss_family != AF_UNIX;
     int n = 1;
     socklen_t len;
     int err;
@@ -741,12 +1740,40 @@ listen_on (int dgram, struct sockaddr_storage *ss)
     }
     if (!dgram)
         setsockopt (s, SOL_SOCKET, SO_REUSEADDR, (char *) &n, sizeof (n));
+#ifdef SO_REUSEPORT
+    else if (opt_reuseport
+             && setsockopt (s, SOL_SOCKET, SO_REUSEPORT, &n, sizeof (n)) < 0) {
+        perror ("SO_REUSEPORT");
+        close (s);
+        return -1;
+    }
+#endif /* SO_REUSEPORT */
+    /* A datagram path left behind by an earlier run */
+    if (dgram && !udp)
+        unlink (((struct sockaddr_un *) ss)->sun_path);
+#ifdef __linux__
+    if (udp && opt_timestamps) {
+        int tsflags = SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE
+            | SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+        if (setsockopt (s, SOL_SOCKET, SO_TIMESTAMPNS, &n, sizeof (n)) < 0
+                || setsockopt (s, SOL_SOCKET, SO_TIMESTAMPING,
+                               &tsflags, sizeof (tsflags)) < 0)
+            perror ("SO_TIMESTAMPING");
+    }
+#endif /* __linux__ */
+#ifdef SO_BUSY_POLL
+    /* Only a hint, raising it needs CAP_NET_ADMIN */
+    if (udp && opt_busy_poll
+            && setsockopt (s, SOL_SOCKET, SO_BUSY_POLL,
+                           &opt_busy_poll, sizeof (opt_busy_poll)) < 0)
+        perror ("SO_BUSY_POLL");
+#endif /* SO_BUSY_POLL */
     if (bind (s, (const struct sockaddr *) ss, addrsize (ss)) < 0) {
         perror ("bind");
         close (s);
         return -1;
     }
-    if (!dgram && listen (s, 5) < 0) {
+    if (!dgram && listen (s, SOMAXCONN) < 0) {
         perror ("listen");
         close (s);
         return -1;
@@ -799,13 +1826,44 @@ connect_to (int dgram, const struct sockaddr_storage *ss)
     return s;
 }
 
+#if !RLIB_UTIL_ONLY
 static int
 debug_recv (int s, packet_t *buf, size_t len, int flags,
 struct sockaddr_storage *from)
 {
     socklen_t socklen = sizeof (*from);
     int n;
-    if (from)
+    STAGE (STAGE_RECV);
+
+    rx_stamp = 0;
+    if (opt_timestamps) {
+        /* SO_TIMESTAMPNS, and the three of SO_TIMESTAMPING */
+        char control[CMSG_SPACE (sizeof (struct timespec))
+                     + CMSG_SPACE (3 * sizeof (struct timespec))];
+        static int truncated;
+        struct iovec iov = { buf, len };
+        struct msghdr msg;
+        struct cmsghdr *cm;
+
+        memset (&msg, 0, sizeof (msg));
+        msg.msg_name = from;
+        msg.msg_namelen = from ? socklen : 0;
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof (control);
+        n = recvmsg (s, &msg, flags);
+        if (n >= 0 && (msg.msg_flags & MSG_CTRUNC) && !truncated++)
+            fprintf (stderr, "%s: receive timestamps truncated\n", progname);
+        for (cm = n < 0 ? NULL : CMSG_FIRSTHDR (&msg); cm; cm = CMSG_NXTHDR (&msg, cm))
+            if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_TIMESTAMPNS) {
+                struct timespec ts;
+                memcpy (&ts, CMSG_DATA (cm), sizeof (ts));
+                rx_stamp = stamp_usec (&ts);
+                hist_record (&rx_delay, now_usec () - rx_stamp);
+            }
+    }
+    else if (from)
         n = recvfrom (s, buf, len, flags, (struct sockaddr *) from, &socklen);
     else
         n = recv (s, buf, len, flags);
@@ -814,15 +1872,262 @@ struct sockaddr_storage *from)
     return n;
 }
 
+#endif /* !RLIB_UTIL_ONLY */
+
+#if !RLIB_NO_MAIN
+static void
+dump_handler (int sig)
+{
+    (void) sig;
+    dump_requested = 1;
+}
+
+/* Servers: leave the event loop on SIGTERM, so that exit flushes the logs */
+static volatile sig_atomic_t term_requested;
+
+static void
+term_handler (int sig)
+{
+    (void) sig;
+    term_requested = 1;
+}
+
 static void
 usage (void)
 {
     fprintf (stderr,
                 "usage: %s udp-port [host:]udp-port\n"
-                , progname);
+                "       %s -s [-N workers] udp-port [host:]tcp-port\n"
+                "options: -w window -t timeout-ms -d -l\n"
+                "         -m udp-port,[host:]udp-port  stripe over another path\n"
+                "         -P bytes  largest payload, 64 to 500 (the peers use the smaller)\n"
+                "         -A n    ack every n packets received in order\n"
+                "         -M kbytes  cap on the data all connections buffer\n"
+                "         -B usec spin that long for the next packet before blocking\n"
+                "         -C cpu  pin to cpu (server workers to cpu, cpu+1, ...)\n"
+                "         -p      read input and write output on threads of their own\n"
+                "                 (with -C, pinned to cpu+1 and cpu+2)\n"
+                "         -T      take rtt samples from kernel timestamps\n"
+                "         -i      if stdin is a file, send it from a mapping\n"
+                "         -o      if stdout is a file, write data from -i senders in place\n"
+                "         -u      udp-ports are paths of unix domain datagram sockets\n"
+                "         -K      with -u, send without checksums and accept such packets\n"
+                "         -R      with -u, move packets over a shared-memory ring\n"
+                "         -L kbytes[,rotate-kbytes][,drop]  -l with that much buffer\n"
+                "                 per log, a new file per rotate-kbytes, and dropping\n"
+                "                 what does not fit instead of waiting\n"
+                "         -x file record a trace of the connection for bench/replay\n"
+                "         -D udp-port,[host:]udp-port  send the same input to another\n"
+                "                 receiver as well (fan-out)\n"
+                "         -G packets[,drop]  fan-out: hold that much for the slowest\n"
+                "                 receiver, then wait for it, or cut it off with drop\n"
+                "         -z      compress payload (the receiver always decompresses)\n"
+                "         -F n|a  send a parity packet per n data packets, or adapt n to loss\n"
+                "         -S rfd,wfd  carry another stream, read from fd rfd and\n"
+                "                     written to fd wfd (both sides need the same -S count)\n"
+                , progname, progname);
     exit (1);
 }
 
+/* Pins the process to one cpu, for -C */
+static void
+pin_cpu (int cpu)
+{
+#ifdef __linux__
+    cpu_set_t set;
+
+    CPU_ZERO (&set);
+    CPU_SET (cpu, &set);
+    if (sched_setaffinity (0, sizeof (set), &set) < 0)
+        perror ("sched_setaffinity");
+#else /* !__linux__ */
+    fprintf (stderr, "%s: -C is not supported here\n", progname);
+#endif /* !__linux__ */
+}
+
+/* Fork n server workers.  Returns in each worker; the parent stays
+ * behind, relays SIGUSR1 to the workers and exits once they are all
+ * gone.  Every worker binds its own SO_REUSEPORT socket, so the kernel
+ * spreads clients over the workers by their address and keeps each
+ * client on the same worker.  Workers share nothing: each has its own
+ * connection table, event loop and counters. */
+static int
+spawn_workers (int n)
+{
+    pid_t *pids = xmalloc (n * sizeof (*pids));
+    int i, status;
+
+    opt_reuseport = 1;
+    for (i = 0; i < n; i++) {
+        if ((pids[i] = fork ()) < 0) {
+            perror ("fork");
+            exit (1);
+        }
+        if (pids[i] == 0) {
+            free (pids);
+#ifdef __linux__
+            prctl (PR_SET_PDEATHSIG, SIGTERM);
+#endif /* __linux__ */
+            return i;
+        }
+    }
+
+    for (;;) {
+        pid_t pid = wait (&status);
+        if (pid >= 0) {
+            fprintf (stderr, "%s: worker %d exited\n", progname, (int) pid);
+            continue;
+        }
+        if (errno != EINTR)
+            exit (0);
+        if (dump_requested) {
+            dump_requested = 0;
+            for (i = 0; i < n; i++)
+                kill (pids[i], SIGUSR1);
+        }
+    }
+}
+
+/* -R: the ring this side receives on */
+static int
+ring_setup (conn_t *c)
+{
+#ifdef __linux__
+    if (!(c->rx_ring = ring_shm_create (RING_SLOTS, sizeof (packet_t), &c->rx_mfd)))
+        return -1;
+    if ((c->rx_efd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        ring_shm_unmap (c->rx_ring);
+        close (c->rx_mfd);
+        c->rx_ring = NULL;
+        return -1;
+    }
+    return 0;
+#else /* !__linux__ */
+    errno = ENOSYS;
+    return -1;
+#endif /* !__linux__ */
+}
+
+/* -l: write out what the log threads still have */
+static void
+logs_close (void)
+{
+    if (log_in)
+        logq_close (log_in);
+    if (log_out)
+        logq_close (log_out);
+    log_in = log_out = NULL;
+}
+
+/* -x: the end of the trace says what came out */
+static void
+trace_close (void)
+{
+    struct trace_end e = { trace_bytes_out, trace_out_hash, trace_sends };
+    trace_rec (TRACE_END, &e, sizeof (e));
+    logq_close (trace);
+    trace = NULL;
+}
+
+/* -l: PID.in.log and PID.out.log, each with its own log thread */
+static void
+logs_open (size_t kbytes, uint64_t rotate, int policy)
+{
+    char name[40];
+    snprintf (name, sizeof (name), "%d.in.log", (int) getpid ());
+    log_in = logq_open (name, kbytes * 1024, rotate, policy);
+    snprintf (name, sizeof (name), "%d.out.log", (int) getpid ());
+    log_out = logq_open (name, kbytes * 1024, rotate, policy);
+    atexit (logs_close);
+}
+
+/* A client's socket bound to local and meant for remote */
+static conn_t *
+client_open (int family, char *local, char *remote)
+{
+    struct sockaddr_storage sl, sr;
+    conn_t *cn = conn_alloc ();
+
+    if (get_address (&sr, 0, 1, family, remote) < 0
+            || get_address (&sl, 1, 1, sr.ss_family, local) < 0
+            || (cn->nfd = listen_on (1, &sl)) < 0)
+        exit (1);
+    /* connect to a unix path fails until the peer has bound it */
+    if (family == AF_UNIX)
+        cn->unconnected = 1;
+    else if (connect (cn->nfd, (struct sockaddr *) &sr, addrsize (&sr)) < 0) {
+        perror ("connect");
+        exit (1);
+    }
+    cn->peer = sr;
+    make_async (cn->nfd);
+    return cn;
+}
+
+/* Fan-out: a group on stdin, and a member for each local,remote pair
+ * in fans; what the receivers send back is thrown away */
+static void
+fanout_init (const struct config_common *cc, int family, char **fans,
+             int nfans, size_t lag, int drop, int pipelined, int cpu)
+{
+    conn_t *in = conn_alloc ();
+    rel_t *group;
+
+    in->rfd = 0;
+    in->wfd = 1;
+    in->nfd = -1;
+    if (pipelined) {
+        if (!(in->pl = pipeline_start (in->rfd, in->wfd,
+                                       cpu >= 0 ? cpu + 1 : -1))) {
+            perror ("pipeline");
+            exit (1);
+        }
+    }
+    else {
+        make_async (in->rfd);
+        make_async (in->wfd);
+    }
+    group = in->rel = rel_create (in, NULL, cc);
+    rel_fanout (group, lag, drop);
+
+    for (int i = 0; i < nfans; i++) {
+        char *remote = fans[i];
+        char *local = strsep (&remote, ",");
+        conn_t *cn;
+
+        if (!remote)
+            usage ();
+        cn = client_open (family, local, remote);
+        cn->rfd = -1;
+        cn->read_eof = 1;
+        if ((cn->wfd = open ("/dev/null", O_WRONLY)) < 0) {
+            perror ("/dev/null");
+            exit (1);
+        }
+        cn->rel = rel_create (cn, NULL, cc);
+        rel_fanout_join (group, cn->rel);
+    }
+}
+
+static void
+server_init (const struct config_common *cc, int family, char *local, char *remote)
+{
+    struct sockaddr_storage sl;
+
+    serverconf = xmalloc (sizeof (*serverconf));
+    memset (serverconf, 0, sizeof (*serverconf));
+    serverconf->c = *cc;
+    if (get_address (&serverconf->dest, 0, 0, AF_UNSPEC, remote) < 0
+            || get_address (&sl, 1, 1, family, local) < 0
+            || (serverconf->udp_socket = listen_on (1, &sl)) < 0)
+        exit (1);
+    make_async (serverconf->udp_socket);
+
+    conn_mkevents ();
+    cevents[0].fd = serverconf->udp_socket;
+    cevents[0].events = POLLIN;
+}
+
 int
 main (int argc, char **argv)
 {
@@ -832,6 +2137,24 @@ main (int argc, char **argv)
         { NULL, 0, NULL, 0 }
     };
     int opt;
+    int server = 0;
+    int workers = 1;
+    int cpu = -1;
+    int family = AF_INET;
+    int log = 0;
+    size_t log_kbytes = 1024;
+    uint64_t log_rotate = 0;
+    int log_policy = LOGQ_BLOCK;
+    int pipelined = 0;
+    char *trace_name = NULL;
+    char *paths[MAX_PATHS];
+    int npaths = 1;
+    char *streams[MAX_STREAMS];
+    int nstreams = 1;
+    char **fans = xmalloc (argc * sizeof (*fans));
+    int nfans = 1;
+    size_t lag = 0;
+    int lag_drop = 0;
     char *local = NULL;
     char *remote = NULL;
     struct config_common c;
@@ -842,6 +2165,10 @@ main (int argc, char **argv)
     sa.sa_handler = SIG_IGN;
     sigaction (SIGPIPE, &sa, NULL);
 
+    /* Dump protocol counters on SIGUSR1 */
+    sa.sa_handler = dump_handler;
+    sigaction (SIGUSR1, &sa, NULL);
+
     memset (&c, 0, sizeof (c));
     c.window = 1;
     c.timeout = 2000;
@@ -852,22 +2179,107 @@ main (int argc, char **argv)
     else
         progname = argv[0];
 
-    while ((opt = getopt_long (argc, argv, "cdust:w:l", o, NULL)) != -1)
+    while ((opt = getopt_long (argc, argv, "cdpsuzioKRA:B:C:D:F:G:L:M:N:P:Tm:S:t:w:x:l", o, NULL)) != -1)
         switch (opt) {
         case 'd':
             opt_debug = 1;
             break;
+        case 's':
+            server = 1;
+            break;
+        case 'N':
+            workers = atoi (optarg);
+            break;
+        case 'm':
+            if (npaths == MAX_PATHS)
+                usage ();
+            paths[npaths++] = optarg;
+            break;
+        case 'z':
+            c.compress = 1;
+            break;
+        case 'P':
+            c.payload = atoi (optarg);
+            break;
+        case 'A':
+            c.ack_every = atoi (optarg);
+            break;
+        case 'M':
+            c.mem_limit = atoi (optarg);
+            break;
+        case 'B':
+            opt_busy_poll = atoi (optarg);
+            break;
+        case 'C':
+            cpu = atoi (optarg);
+            break;
+        case 'p':
+            pipelined = 1;
+            break;
+        case 'T':
+            opt_timestamps = 1;
+            break;
+        case 'i':
+            c.map_input = 1;
+            break;
+        case 'o':
+            c.place_output = 1;
+            break;
+        case 'u':
+            family = AF_UNIX;
+            break;
+        case 'K':
+            c.no_cksum = 1;
+            break;
+        case 'R':
+            opt_ring = 1;
+            break;
+        case 'F':
+            c.fec = optarg[0] == 'a' ? FEC_ADAPTIVE : atoi (optarg);
+            break;
+        case 'S':
+            if (nstreams == MAX_STREAMS)
+                usage ();
+            streams[nstreams++] = optarg;
+            break;
         case 'l':
+            log = 1;
+            break;
+        case 'x':
+            trace_name = optarg;
+            break;
+        case 'D':
+            fans[nfans++] = optarg;
+            break;
+        case 'G':
+            {
+                char *arg = optarg, *tok = strsep (&arg, ",");
+                if (atoi (tok) <= 0)
+                    usage ();
+                lag = atoi (tok);
+                if (arg && !strcmp (arg, "drop"))
+                    lag_drop = 1;
+                else if (arg && strcmp (arg, "block"))
+                    usage ();
+            }
+            break;
+        case 'L':
             {
-                char name[40];
-                snprintf (name, sizeof (name), "%d.in.log", (int) getpid ());
-                log_in = open (name, O_CREAT|O_TRUNC|O_WRONLY, 0666);
-                if (log_in < 0)
-                    perror (name);
-                snprintf (name, sizeof (name), "%d.out.log", (int) getpid ());
-                log_out = open (name, O_CREAT|O_TRUNC|O_WRONLY, 0666);
-                if (log_out < 0)
-                    perror (name);
+                char *arg = optarg, *tok = strsep (&arg, ",");
+                log = 1;
+                log_kbytes = atoi (tok);
+                while ((tok = strsep (&arg, ","))) {
+                    if (!strcmp (tok, "drop"))
+                        log_policy = LOGQ_DROP;
+                    else if (!strcmp (tok, "block"))
+                        log_policy = LOGQ_BLOCK;
+                    else if (atoi (tok) > 0)
+                        log_rotate = (uint64_t) atoi (tok) * 1024;
+                    else
+                        usage ();
+                }
+                if ((int) log_kbytes <= 0)
+                    usage ();
             }
             break;
         case 'w':
@@ -881,33 +2293,144 @@ main (int argc, char **argv)
             break;
         }
 
-    if (optind + 2 != argc || c.window < 1 || c.timeout < 10) {
+    if (optind + 2 != argc || c.window < 1 || c.timeout < 10
+            || (c.fec < 0 && c.fec != FEC_ADAPTIVE)
+            || (c.payload && (c.payload < 64 || c.payload > 500))
+            || c.ack_every < 0 || c.mem_limit < 0 || opt_busy_poll < 0
+            || ((c.no_cksum || opt_ring) && family != AF_UNIX)
+            || (opt_ring && (server || npaths > 1))
+            || (pipelined && (server || c.map_input || c.place_output))
+            || (trace_name && (server || npaths > 1 || nstreams > 1
+                               || c.map_input || c.place_output))
+            || workers < 1 || (workers > 1 && !server)
+            || ((npaths > 1 || nstreams > 1) && server)
+            || (lag && nfans == 1)
+            || (nfans > 1 && (server || npaths > 1 || nstreams > 1 || opt_ring
+                              || trace_name || c.compress || c.map_input
+                              || c.place_output))) {
         usage ();
     }
 
+    /* Server workers open their own logs once forked */
+    if (log && workers == 1)
+        logs_open (log_kbytes, log_rotate, log_policy);
+
     c.timer = c.timeout / 5;
+    if (trace_name) {
+        struct trace_config tc = { TRACE_MAGIC, TRACE_VERSION, c };
+        if (!(trace = logq_open (trace_name, 4096 * 1024, 0, LOGQ_BLOCK)))
+            exit (1);
+        tc.cc.single_connection = 1;
+        trace_rec (TRACE_CONFIG, &tc, sizeof (tc));
+        atexit (trace_close);
+    }
     local = argv[optind];
     remote = argv[optind+1];
 
-    struct sockaddr_storage sl, sr;
-    conn_t *cn = conn_alloc ();
+    if (nfans > 1) {
+        char *pair = xmalloc (strlen (local) + strlen (remote) + 2);
+        sprintf (pair, "%s,%s", local, remote);
+        fans[0] = pair;
+        /* no single_connection: one receiver going away leaves the others */
+        fanout_init (&c, family, fans, nfans, lag ? lag : 4 * (size_t) c.window,
+                     lag_drop, pipelined, cpu);
+        free (pair);
+        free (fans);
+        if (cpu >= 0)
+            pin_cpu (cpu);
+        conn_mkevents ();
+        while (conn_list)
+            conn_poll (&c);
+        return 0;
+    }
+
+    if (server) {
+        int worker = 0;
+        if (workers > 1) {
+            worker = spawn_workers (workers);
+            if (log)
+                logs_open (log_kbytes, log_rotate, log_policy);
+        }
+        sa.sa_handler = term_handler;
+        sigaction (SIGTERM, &sa, NULL);
+        if (cpu >= 0)
+            pin_cpu (cpu + worker);
+        server_init (&c, family, local, remote);
+        while (!term_requested)
+            conn_poll (&c);
+        exit (0);
+    }
+
+    free (fans);
+
+    struct sockaddr_storage sl;
+    conn_t *cn = client_open (family, local, remote);
     c.single_connection = 1;
     cn->rfd = 0;
     cn->wfd = 1;
-    if (get_address (&sr, 0, 1, AF_INET, remote) < 0
-            || get_address (&sl, 1, 1, sr.ss_family, local) < 0
-            || (cn->nfd = listen_on (1, &sl)) < 0)
-        exit (1);
-    if (connect (cn->nfd, (struct sockaddr *) &sr, addrsize (&sr)) < 0) {
-        perror ("connect");
-        exit (1);
+    if (npaths > 1) {
+        cn->npaths = npaths;
+        cn->path[0].nfd = cn->nfd;
+        cn->path[0].peer = cn->peer;
+    }
+    for (int i = 1; i < npaths; i++) {
+        struct path *p = &cn->path[i];
+        char *l = strsep (&paths[i], ",");
+        if (!paths[i])
+            usage ();
+        if (get_address (&p->peer, 0, 1, family, paths[i]) < 0
+                || get_address (&sl, 1, 1, p->peer.ss_family, l) < 0
+                || (p->nfd = listen_on (1, &sl)) < 0)
+            exit (1);
+        if (connect (p->nfd, (struct sockaddr *) &p->peer,
+                     addrsize (&p->peer)) < 0) {
+            perror ("connect");
+            exit (1);
+        }
+        make_async (p->nfd);
+    }
+    if (nstreams > 1) {
+        cn->nstreams = nstreams;
+        cn->streams = xmalloc ((nstreams - 1) * sizeof (struct stream));
+        memset (cn->streams, 0, (nstreams - 1) * sizeof (struct stream));
+    }
+    for (int i = 1; i < nstreams; i++) {
+        struct stream *st = &cn->streams[i-1];
+        char *w = streams[i];
+        char *r = strsep (&w, ",");
+        if (!w)
+            usage ();
+        st->rfd = atoi (r);
+        st->wfd = atoi (w);
+        st->outqtail = &st->outq;
+        if (fcntl (st->rfd, F_GETFD) < 0 || fcntl (st->wfd, F_GETFD) < 0) {
+            fprintf (stderr, "%s: -S %s,%s: bad file descriptor\n", progname, r, w);
+            exit (1);
+        }
+        make_async (st->rfd);
+        make_async (st->wfd);
+    }
+    if (pipelined) {
+        if (!(cn->pl = pipeline_start (cn->rfd, cn->wfd,
+                                       cpu >= 0 ? cpu + 1 : -1))) {
+            perror ("pipeline");
+            exit (1);
+        }
+    }
+    else {
+        make_async (cn->rfd);
+        make_async (cn->wfd);
+    }
+    if (opt_ring) {
+        if (ring_setup (cn) < 0) {
+            perror ("ring");
+            exit (1);
+        }
+        ring_offer (cn);
     }
-    cn->server = 0;
-    cn->peer = sr;
-    make_async (cn->rfd);
-    make_async (cn->wfd);
-    make_async (cn->nfd);
     cn->rel = rel_create (cn, NULL, &c);
+    if (cpu >= 0)
+        pin_cpu (cpu);
 
     conn_mkevents ();
     while (conn_list)
@@ -915,3 +2438,4 @@ main (int argc, char **argv)
 
     return 0;
 }
+#endif /* !RLIB_NO_MAIN */
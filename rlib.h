@@ -3,6 +3,7 @@
 #endif /* DMALLOC */
 
 #include <stdint.h>
+#include <stdio.h>
 #include <sys/types.h>
 
 /* -----------------------------------------------------------------------
@@ -61,6 +62,61 @@
    unacknowledged Data frame with less than the maximum number of
    packets (500), somewhat like TCP's Nagle algorithm.
 
+   Multi-stream mode (-S on both sides) carries several independent
+   byte streams in one connection.  Sequence numbers and acks stay
+   per connection, but the payload of every Data packet except the
+   final EOF starts with a struct stream_hdr naming the stream and
+   numbering the packet within it (sseq, from 1).  A stream header
+   with STREAM_EOF and no data after it ends that stream; the
+   connection EOF follows once all streams have ended.  The receiver
+   delivers each stream in sseq order, so a lost packet only holds up
+   its own stream.  Once the peer's hello has HELLO_F_STREAMS, acks get
+   PKT_F_CREDIT in len and are followed by one 32-bit credit per
+   stream: the sender may send packets of stream s up to, but not
+   including, sseq credit[s].
+
+   With forward error correction (-F) the sender follows every group
+   of up to FEC_MAX_GROUP consecutive data packets with a parity
+   packet (PKT_F_PARITY in len, see struct parity_packet) holding the
+   XOR of their payloads.  A receiver that misses exactly one packet of
+   a group rebuilds it from the parity and the others, without waiting
+   for a retransmission.  Receivers always decode parity packets, so
+   only the sender needs -F.
+
+   Once the peer's hello has HELLO_F_WINDOW, acks carry PKT_F_WINDOW
+   in len and a 32-bit window after ackno (struct window_ack): the
+   receiver takes seqnos below ackno + window.  A receiver acks what it
+   has buffered, not only what it has output, and shrinks the window
+   while its output is backed up.  Facing a zero window, a sender keeps
+   one packet in flight as a probe; a packet beyond the window is
+   answered with a fresh ack.  Plain 8-byte acks remain valid and leave
+   the window as it was.
+
+   Each side introduces itself with a struct hello after a plain ack
+   header, flagged with PKT_F_HELLO in len, sent after each of the
+   first few packets it sends.  A peer without hellos drops these as
+   malformed, and everything else either side sends it keeps to the
+   original format.  The peers use the smaller of their windows,
+   payload sizes and ack intervals, and only the features both
+   announce; a hello of another HELLO_VERSION ends the connection.  A
+   connection without a hello from the peer uses none of the optional
+   features, so either side may be a peer without them.  Buffers keep
+   the size each side was started with; the agreed window only limits
+   what is sent.
+
+   With compression (-z) the payload of a data packet may be an
+   independent LZ block (see lz.h), marked by PKT_F_LZ in len.  Such a
+   packet decompresses to at most LZ_STAGE bytes.
+
+   A sender in file mode (-i) whose peer's hello has HELLO_F_OFFSET
+   puts the offset of the payload in the stream, a struct data_offset,
+   in front of the payload and flags the packet with PKT_F_OFFSET.  It
+   does so from the first seqno it cannot have sent before the hello
+   on; earlier seqnos go without, every time.  A receiver writing to a
+   file (-o) can then write each packet where it belongs as soon as it
+   arrives; any other receiver just drops the offset.  Parity covers
+   the offset like payload.
+
  */
 
 
@@ -80,6 +136,64 @@ struct packet {
 };
 typedef struct packet packet_t;
 
+struct window_ack {
+    uint16_t cksum;
+    uint16_t len;			/* 12 | PKT_F_WINDOW */
+    uint32_t ackno;
+    uint32_t window;		/* In packets, counted from ackno */
+};
+
+struct hello {
+    uint16_t version;		/* HELLO_VERSION */
+    uint16_t payload;		/* Largest payload wanted, <= 500 */
+    uint32_t window;		/* Receive window, in packets */
+    uint32_t features;		/* HELLO_F_ */
+    uint16_t nstreams;		/* Must match on both sides */
+    uint16_t ack_every;		/* Acks after this many packets in order */
+};
+#define HELLO_VERSION   2
+#define HELLO_F_WINDOW  0x0001	/* Sends window acks */
+#define HELLO_F_STREAMS 0x0002	/* Multi-stream mode, nstreams > 1 */
+#define HELLO_F_FEC     0x0004	/* Decodes parity packets */
+#define HELLO_F_LZ      0x0008	/* Decodes compressed payload */
+#define HELLO_F_OFFSET  0x0010	/* Takes data with PKT_F_OFFSET */
+
+/* Flags in the top bits of len; the length itself is len & PKT_LEN_MASK */
+#define PKT_LEN_MASK 0x03ff
+#define PKT_F_CREDIT 0x8000	/* Ack followed by per-stream credits */
+#define PKT_F_PARITY 0x4000	/* FEC parity packet */
+#define PKT_F_LZ     0x2000	/* Data: payload is compressed */
+#define PKT_F_WINDOW 0x1000	/* Ack followed by the receive window */
+#define PKT_F_HELLO  0x0800	/* Ack followed by a struct hello */
+#define PKT_F_OFFSET 0x0400	/* Data: a struct data_offset comes first */
+
+struct data_offset {
+    uint32_t hi;
+    uint32_t lo;
+};
+#define LZ_STAGE 8192
+
+#define MAX_STREAMS 16
+
+struct stream_hdr {
+    uint16_t stream;
+    uint16_t flags;		/* STREAM_EOF */
+    uint32_t sseq;		/* Packet number within the stream */
+};
+#define STREAM_EOF 0x0001
+
+/* The header has the size of a data packet header, but no ackno */
+struct parity_packet {
+    uint16_t cksum;
+    uint16_t len;		/* 12 + longest payload, | PKT_F_PARITY */
+    uint16_t count;		/* Covers seqno .. seqno + count - 1 */
+    uint16_t len_xor;		/* XOR of their payload lengths */
+    uint32_t seqno;
+    char data[500];		/* XOR of their payloads, zero padded */
+};
+#define FEC_MAX_GROUP 32
+#define FEC_ADAPTIVE -1
+
 /* -----------------------------------------------------------------------
 
    Important notes about the library:
@@ -176,6 +290,15 @@ struct config_common {
     int timer;			/* How often rel_timer called in milliseconds */
     int timeout;			/* Retransmission timeout in milliseconds */
     int single_connection;        /* Exit after first connection failure */
+    int fec;			/* Data packets per parity packet, 0 for
+				   none, FEC_ADAPTIVE to follow the loss */
+    int compress;			/* Compress payload with lz */
+    int payload;			/* Largest payload, 500 if 0 */
+    int ack_every;		/* Ack every that many packets, 1 if 0 */
+    int mem_limit;		/* Cap on buffered data in kbytes, 0 for none */
+    int map_input;		/* Send a regular file from a mapping */
+    int place_output;		/* Write data to a file at its offset */
+    int no_cksum;			/* Send checksum 0, and accept it */
 };
 
 typedef struct reliable_state rel_t;
@@ -205,6 +328,9 @@ size_t addrsize (const struct sockaddr_storage *ss);
 /* Useful for debugging. */
 void print_pkt (const packet_t *buf, const char *op, int n);
 
+/* Current CLOCK_MONOTONIC time in microseconds. */
+uint64_t now_usec (void);
+
 /* This is an opaque structure provided by rlib.  You only need
  * pointers to it.  */
 typedef struct conn conn_t;
@@ -216,6 +342,20 @@ conn_t *conn_create (rel_t *, const struct sockaddr_storage *);
 /* Call this function to send a UDP packet to the other side. */
 int conn_sendpkt (conn_t *c, const packet_t *pkt, size_t len);
 
+/* Multipath (-m): conn_sendpkt spreads packets over several paths,
+ * weighted by their rtt and loss.  conn_lastpath tells you which path
+ * the last conn_sendpkt used, and conn_path_feedback feeds back an rtt
+ * sample (usec) or, with lost != 0, a loss for a packet sent on it.
+ * Both are harmless without multipath. */
+int conn_lastpath (conn_t *c);
+void conn_path_feedback (conn_t *c, int path, uint64_t rtt, int lost);
+
+/* When the packet rel_recvpkt (or rel_demux) is handling arrived, in
+ * now_usec time.  With -T that is the kernel's receive timestamp, so
+ * rtt samples leave out how long the packet waited for the event
+ * loop; otherwise it is simply now_usec (). */
+uint64_t conn_rxtime (conn_t *c);
+
 /* This function tells you how many bytes of output buffering are free
  * for conn_output to store your data.  conn_output is guaranteed not
  * to return 0 if you write less than this many bytes. */
@@ -234,12 +374,34 @@ size_t conn_bufspace (conn_t *c);
  * write. */
 int conn_output (conn_t *c, const void *buf, size_t len);
 
+/* Direct placement (-o): writes all of buf at offset off of the
+ * output, counted from where it started, whatever came before it.
+ * Returns len, or -1 if the output cannot seek or the write failed.
+ * len 0 only checks the output.  Don't mix with conn_output, except
+ * for its EOF. */
+int conn_output_at (conn_t *c, const void *buf, size_t len, uint64_t off);
+
 /* Get some input from the reliable side.  You must must then put the
  * data into UDP sockets which you send out with conn_sendpkt.  This
  * function returns the number of bytes received, 0 if there is no
  * data currently available, and -1 on EOF or error. */
 int conn_input (conn_t *c, void *buf, size_t len);
 
+/* File send mode (-i): if the input is a regular file, the rest of it
+ * mapped read-only, with its length in *len; NULL otherwise.  The
+ * mapping lives as long as c.  Use it instead of conn_input, not
+ * along with it. */
+const char *conn_input_map (conn_t *c, size_t *len);
+
+/* Multi-stream (-S): conn_nstreams tells you how many streams the
+ * connection carries, 1 without -S.  Stream 0 is the one conn_input
+ * and conn_output use; the conn_stream_ functions behave like those
+ * and conn_bufspace, for stream s. */
+int conn_nstreams (conn_t *c);
+int conn_stream_input (conn_t *c, int s, void *buf, size_t len);
+int conn_stream_output (conn_t *c, int s, const void *buf, size_t len);
+size_t conn_stream_bufspace (conn_t *c, int s);
+
 /* Deallocate a connection */
 void conn_destroy (conn_t *c);
 
@@ -252,11 +414,32 @@ void rel_destroy (rel_t *);
 /* This function gets called on clients, when packets arrive: */
 void rel_recvpkt (rel_t *, packet_t *pkt, size_t len);
 
+/* This function gets called on the server, for every packet arriving
+ * on the shared UDP socket.  It finds (or creates) the rel_t for the
+ * client at ss and passes the packet to rel_recvpkt. */
+void rel_demux (const struct config_common *cc,
+                const struct sockaddr_storage *ss,
+                packet_t *pkt, size_t len);
+
 /* Notification handlers */
 void rel_read (rel_t *);    /* Invoked when you can call conn_input */
 void rel_output (rel_t *);  /* Invoked when some output drained */
 void rel_timer (void); /* Invoked roughly each timer/5 milliseconds */
 
+/* Print the protocol counters of a connection to f, or the process
+ * totals if r is NULL.  rlib calls this when the process receives
+ * SIGUSR1, so the counters can be read while a transfer is running. */
+void rel_dump_stats (rel_t *, FILE *);
+
+/* Fan-out: the rel_t of a connection that has the input but no
+ * network becomes a group, which reads the input once and sends it
+ * over every connection that joins it.  lag is how many packets the
+ * group holds for its slowest member; with drop set, a member that
+ * falls further behind is cut off instead of waited for.  Members
+ * join before the group reads anything. */
+void rel_fanout (rel_t *group, size_t lag, int drop);
+void rel_fanout_join (rel_t *group, rel_t *member);
+
 
 
 /* Below are some utility functions you don't need for this lab */
@@ -0,0 +1,160 @@
+#include <stdio.h>
+#include <inttypes.h>
+
+#include "stats.h"
+
+struct rel_stats rel_totals;
+
+void
+stats_print (FILE *f, const char *prefix, const struct rel_stats *st)
+{
+#define P(field) \
+    fprintf (f, "%s%-14s %" PRIu64 "\n", prefix, #field, st->field)
+    P (pkts_sent);
+    P (bytes_sent);
+    P (acks_sent);
+    P (pkts_recv);
+    P (bytes_recv);
+    P (acks_recv);
+    P (retransmits);
+    P (dup_dropped);
+    P (out_of_window);
+    P (cksum_fail);
+    P (len_fail);
+    P (window_stalls);
+    P (outbuf_full);
+    P (fec_sent);
+    P (fec_recovered);
+    P (lz_saved);
+    P (zero_window);
+    P (acks_delayed);
+    P (pool_waits);
+    P (pool_drops);
+    P (send_full);
+    P (lag_waits);
+    P (lag_drops);
+#undef P
+}
+
+static unsigned int
+hist_index (uint64_t v)
+{
+    int msb;
+
+    if (v < HIST_SUB)
+        return v;
+    if (v > UINT32_MAX)
+        v = UINT32_MAX;
+    msb = 63 - __builtin_clzll (v);
+    return (msb - HIST_SUB_BITS + 1) * HIST_SUB
+        + ((v >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+static uint64_t
+hist_value (unsigned int i)
+{
+    unsigned int shift;
+    uint64_t lo;
+
+    if (i < HIST_SUB)
+        return i;
+    shift = i / HIST_SUB - 1;
+    lo = (uint64_t) (HIST_SUB + i % HIST_SUB) << shift;
+    return lo + ((1ULL << shift) >> 1);
+}
+
+void
+hist_record (struct hist *h, uint64_t usec)
+{
+    h->bucket[hist_index (usec)]++;
+    h->count++;
+    h->sum += usec;
+    if (usec > h->max)
+        h->max = usec;
+}
+
+uint64_t
+hist_percentile (const struct hist *h, double p)
+{
+    uint64_t want, seen = 0;
+    unsigned int i;
+
+    if (!h->count)
+        return 0;
+    want = p * h->count;
+    if (want < 1)
+        want = 1;
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->bucket[i];
+        if (seen >= want)
+            return hist_value (i) < h->max ? hist_value (i) : h->max;
+    }
+    return h->max;
+}
+
+void
+hist_print (FILE *f, const char *prefix, const char *name,
+            const struct hist *h)
+{
+    fprintf (f, "%s%-14s n=%" PRIu64 " mean=%" PRIu64 " p50=%" PRIu64
+             " p90=%" PRIu64 " p99=%" PRIu64 " p999=%" PRIu64
+             " max=%" PRIu64 " (usec)\n",
+             prefix, name, h->count, h->count ? h->sum / h->count : 0,
+             hist_percentile (h, 0.50), hist_percentile (h, 0.90),
+             hist_percentile (h, 0.99), hist_percentile (h, 0.999),
+             h->max);
+}
+
+#if RLIB_STAGES
+#include <time.h>
+
+struct stage_total stage_totals[NSTAGES];
+struct stage_frame stage_stack[STAGE_DEPTH];
+int stage_depth;
+
+static const char *const stage_names[NSTAGES] = {
+    "recv", "cksum", "rel_recvpkt", "rel_output", "write",
+    "rel_read", "send_packet", "conn_sendpkt"
+};
+
+static uint64_t clock0, nsec0;
+
+static uint64_t
+wall_nsec (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* The TSC rate, from how far it and the clock moved since startup */
+static void __attribute__ ((constructor))
+stages_start (void)
+{
+    clock0 = stage_clock ();
+    nsec0 = wall_nsec ();
+}
+
+void
+stages_print (FILE *f, const char *prefix)
+{
+    uint64_t ticks = stage_clock () - clock0, nsec = wall_nsec () - nsec0;
+    double ns_per_tick = ticks ? (double) nsec / ticks : 1;
+    uint64_t all = 0;
+    int s;
+
+    for (s = 0; s < NSTAGES; s++)
+        all += stage_totals[s].self;
+    fprintf (f, "%s%-14s %.3f ns/tick\n", prefix, "stages", ns_per_tick);
+    for (s = 0; s < NSTAGES; s++) {
+        const struct stage_total *st = &stage_totals[s];
+        uint64_t n = st->count ? st->count : 1;
+        fprintf (f, "%s  %-14s n=%" PRIu64 " self=%.0f total=%.0f (ns/call)"
+                 " ticks=%" PRIu64 "/%" PRIu64 " %4.1f%%\n",
+                 prefix, stage_names[s], st->count,
+                 st->self / n * ns_per_tick, st->total / n * ns_per_tick,
+                 st->self / n, st->total / n,
+                 all ? 100.0 * st->self / all : 0);
+    }
+}
+#endif /* RLIB_STAGES */
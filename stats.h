@@ -0,0 +1,183 @@
+#include <stdio.h>
+#include <stdint.h>
+
+/* -----------------------------------------------------------------------
+
+   Protocol counters.
+
+   Every rel_t keeps one struct rel_stats, and every counter that is
+   bumped on a connection is also bumped on the process-wide totals in
+   rel_totals, so the totals survive rel_destroy().
+
+   The counters can be dumped at any time by sending SIGUSR1 to the
+   process; the dump is written to stderr from the conn_poll() loop.
+
+ */
+
+struct rel_stats {
+    uint64_t pkts_sent;		/* Data packets, including retransmissions */
+    uint64_t bytes_sent;		/* Payload bytes in those packets */
+    uint64_t acks_sent;		/* Ack-only packets */
+    uint64_t pkts_recv;		/* Data packets that passed all checks */
+    uint64_t bytes_recv;
+    uint64_t acks_recv;
+    uint64_t retransmits;		/* Data packets sent more than once */
+    uint64_t dup_dropped;		/* Data we had already buffered or output */
+    uint64_t out_of_window;	/* Data beyond the receive window */
+    uint64_t cksum_fail;
+    uint64_t len_fail;		/* Length field does not match datagram */
+    uint64_t window_stalls;	/* Times input waited for a free send slot */
+    uint64_t outbuf_full;		/* Times conn_output took less than offered */
+    uint64_t fec_sent;		/* Parity packets */
+    uint64_t fec_recovered;	/* Data packets rebuilt from parity */
+    uint64_t lz_saved;		/* Payload bytes compression kept off the wire */
+    uint64_t zero_window;		/* Times the peer closed its window */
+    uint64_t acks_delayed;	/* Packets the ack policy did not ack at once */
+    uint64_t pool_waits;		/* Times the sender waited for the memory cap */
+    uint64_t pool_drops;		/* Packets dropped at the memory cap */
+    uint64_t send_full;		/* Sends refused by a full socket */
+    uint64_t lag_waits;		/* Fan-out: input waited for the slowest */
+    uint64_t lag_drops;		/* Fan-out: receivers cut off for lagging */
+};
+
+extern struct rel_stats rel_totals;
+
+#define STAT_ADD(r, field, n)					\
+    do {							\
+        (r)->stats.field += (n);				\
+        rel_totals.field += (n);				\
+    } while (0)
+#define STAT_INC(r, field) STAT_ADD (r, field, 1)
+
+/* Print the counters in st, one "name value" pair per line, each
+   line prefixed by prefix. */
+void stats_print (FILE *f, const char *prefix, const struct rel_stats *st);
+
+/* -----------------------------------------------------------------------
+
+   Latency histograms.
+
+   Log-bucketed in the style of HdrHistogram: values below 8 get a
+   bucket each, and every power of two above is split into 8 equal
+   sub-buckets, so a reported percentile is within 12.5% of the true
+   value.  Values are in microseconds and clamp at 2^32-1.
+
+ */
+
+#define HIST_SUB_BITS 3
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((32 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct hist {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t bucket[HIST_BUCKETS];
+};
+
+void hist_record (struct hist *h, uint64_t usec);
+
+/* Value at or below which fraction p (0..1) of the samples lie,
+   reported as the midpoint of its bucket. */
+uint64_t hist_percentile (const struct hist *h, double p);
+
+/* Print count, mean, p50, p90, p99, p99.9 and max on one line. */
+void hist_print (FILE *f, const char *prefix, const char *name,
+                 const struct hist *h);
+
+/* -----------------------------------------------------------------------
+
+   Per-stage cycle counters, in builds with -DRLIB_STAGES=1.
+
+   STAGE (s) at the top of a function or block charges the time until
+   the end of that scope to stage s.  Stages nest: time spent in an
+   inner stage is taken off the outer one, so the per-stage times add
+   up to the time spent in all of them together.  The clock is the TSC
+   where there is one, else CLOCK_MONOTONIC in nanoseconds.  Without
+   RLIB_STAGES, STAGE compiles to nothing.
+
+ */
+
+enum stage {
+    STAGE_RECV,			/* Receive syscall (or ring pop) */
+    STAGE_CKSUM,			/* Checksum verify */
+    STAGE_RECVPKT,		/* rel_recvpkt bookkeeping */
+    STAGE_OUTPUT,			/* rel_output delivery */
+    STAGE_WRITE,			/* conn_output/conn_drain writes */
+    STAGE_READ,			/* rel_read, with the input read */
+    STAGE_SEND,			/* send_packet building the packet */
+    STAGE_SENDTO,			/* conn_sendpkt sending it */
+    NSTAGES
+};
+
+#if RLIB_STAGES
+# if defined (__x86_64__) || defined (__i386__)
+#  include <x86intrin.h>
+# else
+#  include <time.h>
+# endif
+
+#define STAGE_DEPTH 16
+
+struct stage_total {
+    uint64_t count;
+    uint64_t self;		/* clock ticks outside nested stages */
+    uint64_t total;		/* and including them */
+};
+
+extern struct stage_total stage_totals[NSTAGES];
+extern struct stage_frame {
+    uint64_t start, nested;
+} stage_stack[STAGE_DEPTH];
+extern int stage_depth;
+
+static inline uint64_t
+stage_clock (void)
+{
+# if defined (__x86_64__) || defined (__i386__)
+    return __rdtsc ();
+# else
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+# endif
+}
+
+static inline int
+stage_enter (int s)
+{
+    if (stage_depth < STAGE_DEPTH) {
+        stage_stack[stage_depth].nested = 0;
+        stage_stack[stage_depth].start = stage_clock ();
+    }
+    stage_depth++;
+    return s;
+}
+
+static inline void
+stage_exit (const int *s)
+{
+    uint64_t t;
+
+    if (--stage_depth >= STAGE_DEPTH)
+        return;
+    t = stage_clock () - stage_stack[stage_depth].start;
+    stage_totals[*s].count++;
+    stage_totals[*s].total += t;
+    stage_totals[*s].self += t - stage_stack[stage_depth].nested;
+    if (stage_depth > 0)
+        stage_stack[stage_depth - 1].nested += t;
+}
+
+#define STAGE_VAR_(line) stage_scope_##line
+#define STAGE_VAR(line) STAGE_VAR_ (line)
+#define STAGE(s)							\
+    const int STAGE_VAR (__LINE__) __attribute__ ((cleanup (stage_exit), unused)) \
+        = stage_enter (s)
+
+/* Print a line per stage: calls, ticks and nanoseconds per call
+   outside and including nested stages, and its share of the time. */
+void stages_print (FILE *f, const char *prefix);
+#else /* !RLIB_STAGES */
+# define STAGE(s) do { } while (0)
+#endif /* !RLIB_STAGES */
@@ -0,0 +1,64 @@
+#include <stddef.h>
+#include <stdint.h>
+
+/* -----------------------------------------------------------------------
+
+   Trace of a client connection, written with -x and played back by
+   bench/replay.c.
+
+   A trace is a series of records, each a struct trace_rec and len
+   bytes, in host byte order.  The first record is TRACE_CONFIG.  Then
+   come, in the order they happened, the calls rlib made into
+   reliable.c (a datagram for rel_recvpkt, rel_read, rel_output,
+   rel_timer) and what rlib answered when reliable.c called back
+   (conn_input data or EOF, conn_bufspace), each with now_usec() at
+   the time.  TRACE_END closes it with a hash of all that conn_output
+   accepted, so a replay can tell whether it came out the same.
+
+ */
+
+#define TRACE_MAGIC 0x746c6572	/* "relt" */
+#define TRACE_VERSION 1
+
+enum trace_type {
+    TRACE_CONFIG = 1,		/* struct trace_config */
+    TRACE_PKT,			/* A datagram for rel_recvpkt */
+    TRACE_READ,			/* rel_read */
+    TRACE_OUTPUT,			/* rel_output */
+    TRACE_TIMER,			/* rel_timer */
+    TRACE_INPUT,			/* conn_input returned these bytes,
+				   none if there were none to read */
+    TRACE_INPUT_EOF,		/* conn_input returned -1 */
+    TRACE_BUFSPACE,		/* conn_bufspace returned this uint64_t */
+    TRACE_END,			/* struct trace_end */
+};
+
+struct trace_rec {
+    uint32_t type;
+    uint32_t len;
+    uint64_t usec;
+};
+
+struct trace_config {
+    uint32_t magic;
+    uint32_t version;
+    struct config_common cc;
+};
+
+struct trace_end {
+    uint64_t bytes_out;		/* Accepted by conn_output */
+    uint64_t hash;		/* trace_hash of those bytes */
+    uint64_t sends;		/* conn_sendpkt calls */
+};
+
+#define TRACE_HASH_INIT 0xcbf29ce484222325ULL
+
+/* FNV-1a, continued from h over n more bytes */
+static inline uint64_t
+trace_hash (uint64_t h, const void *_buf, size_t n)
+{
+    const uint8_t *buf = _buf;
+    while (n--)
+        h = (h ^ *buf++) * 0x100000001b3ULL;
+    return h;
+}